@@ -10,6 +10,41 @@
 #include <thread>
 #include <chrono>
 #include <sstream>
+#include <set>
+#include <fstream>
+#include <cstdio>
+#include <cstdint>
+#include <mutex>
+#include <condition_variable>
+#include <filesystem>
+#include <random>
+#include <map>
+#include <array>
+#include <atomic>
+#include <shared_mutex>
+#include <string_view>
+#include <unordered_set>
+#include <list>
+#include <charconv>
+#include <cstring>
+#include <type_traits>
+
+#if !defined(_WIN32)
+#include <termios.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#else
+#include <io.h>
+#endif
+
+#if defined(__linux__)
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#endif
 
 class Shell;
 
@@ -94,6 +129,7 @@ public:
 
   std::vector<VGA> VGAList() const; 
   std::vector<RAM> RAMList() const; 
+  std::vector<Storage> StorageList() const;
 
 private:
   std::string name_;
@@ -117,8 +153,13 @@ std::vector<Motherboard::RAM> Motherboard::RAMList() const {
   return ram_list_;
 }
 
+std::vector<Motherboard::Storage> Motherboard::StorageList() const {
+  return storages_;
+}
+
 class Computer {
 public:
+  static Computer Assemble();
   static Computer Boot();
 
   void SetDateTime(const std::chrono::time_point<std::chrono::system_clock> &);
@@ -134,6 +175,10 @@ private:
   std::chrono::time_point<std::chrono::system_clock> time_point_;
 };
 
+Motherboard Computer::GetMotherboard() const {
+  return motherboard_;
+}
+
 Computer::Computer(const Motherboard &motherboard, const std::chrono::time_point<std::chrono::system_clock> &time_point)
   : motherboard_{motherboard}, time_point_{time_point} {}
 
@@ -145,7 +190,7 @@ void Computer::SetDateTime(const std::chrono::time_point<std::chrono::system_clo
   time_point_ = time_point;
 }
 
-Computer Computer::Boot() {
+Computer Computer::Assemble() {
   Motherboard::CPU cpu{"AMD Ryzen 7 2700X", 64};
 
   Motherboard::RAM ram{"Corsair Vengeance DDR4", 8};
@@ -161,6 +206,12 @@ Computer Computer::Boot() {
 
   Motherboard motherboard{"AMD x570", cpu, ram_list, storages, vga_list, power_supply};
 
+  return Computer{motherboard, std::chrono::system_clock::now()};
+}
+
+Computer Computer::Boot() {
+  auto motherboard = Assemble().GetMotherboard();
+
   std::cout << "Finding bios...\n";
   std::this_thread::sleep_for(std::chrono::milliseconds(200));
   std::cout << "BIOS found\n";
@@ -231,10 +282,17 @@ Computer Computer::Boot() {
   return Computer{motherboard, std::chrono::system_clock::now()};
 }
 
+enum class OutputFormat {
+  kText,
+  kJson,
+  kNdjson,
+};
+
 class Argument {
 public:
   bool HasParameters() const;
   bool HasOptions() const;
+  OutputFormat Format() const;
 
   std::string ProgramName() const;
   std::vector<std::string> Parameters() const;
@@ -258,6 +316,19 @@ bool Argument::HasOptions() const {
   return options_.size() > 0;
 }
 
+OutputFormat Argument::Format() const {
+  auto format = OutputFormat::kText;
+  for (const auto &option : options_) {
+    if (option == "--json") {
+      format = OutputFormat::kJson;
+    } else if (option == "--ndjson") {
+      format = OutputFormat::kNdjson;
+    }
+  }
+
+  return format;
+}
+
 std::string Argument::ProgramName() const {
   return program_name_;
 }
@@ -286,658 +357,6229 @@ void Argument::SetParameters(const std::vector<std::string> &parameters) {
 #define WRITE_FLAG 2
 #define EXECUTE_FLAG 1
 
-class FileOrDirectory {
-public:
-
-  static FileOrDirectory CreateDirectory(const std::string &);
+struct Completion {
+  std::string common_prefix;
+  std::vector<std::string> candidates;
+  bool truncated{false};
+};
 
-  static FileOrDirectory CreateFile(const std::string &);
+using NameId = std::uint32_t;
 
-  void Add(const FileOrDirectory &);
-  void SetPermission(unsigned char);
+class NameTable {
+public:
+  static constexpr NameId kMissing = 0xFFFFFFFF;
 
-  std::string Name() const;
-  bool Readable() const;
-  bool Writeable() const;
-  bool Executable() const;
+  static NameTable &Global();
 
-  bool IsDirectory() const;
+  ~NameTable();
 
-  std::shared_ptr<std::vector<FileOrDirectory>> Files() const;
+  NameId Intern(const std::string &);
+  NameId Find(const std::string &) const;
+  const std::string &String(NameId) const;
+  std::size_t Size() const;
 
 private:
-  FileOrDirectory(const std::string &, bool, const std::shared_ptr<std::vector<FileOrDirectory>> &);
+  NameTable() = default;
 
 private:
-  std::shared_ptr<std::vector<FileOrDirectory>> files_;
+  static constexpr std::size_t kChunkBits = 14;
+  static constexpr std::size_t kChunkSize = std::size_t{1} << kChunkBits;
+  static constexpr std::size_t kMaxChunks = std::size_t{1} << 12;
 
-  std::string name_;
-  bool is_directory_;
+  mutable std::shared_mutex mutex_;
+  std::unordered_map<std::string_view, NameId> ids_;
+  NameId size_{0};
 
-  unsigned char permission_{0};
+  // Strings live in fixed-size chunks that never move, so String() can
+  // read them without taking the lock.
+  std::array<std::atomic<std::string *>, kMaxChunks> chunks_{};
 };
 
-FileOrDirectory::FileOrDirectory(const std::string &name, bool is_directory, const std::shared_ptr<std::vector<FileOrDirectory>> &files)
-  : name_{name}, is_directory_{is_directory}, files_{files} {}
+NameTable &NameTable::Global() {
+  static NameTable table;
+  return table;
+}
 
-FileOrDirectory FileOrDirectory::CreateDirectory(const std::string &name) {
-  return {name, true, std::make_shared<std::vector<FileOrDirectory>>()};
+NameTable::~NameTable() {
+  for (auto &chunk : chunks_) {
+    delete[] chunk.load();
+  }
 }
 
-FileOrDirectory FileOrDirectory::CreateFile(const std::string &name) {
-  FileOrDirectory file{name, false, std::make_shared<std::vector<FileOrDirectory>>()};
-  file.SetPermission(READ_FLAG | WRITE_FLAG);
+NameId NameTable::Find(const std::string &name) const {
+  std::shared_lock<std::shared_mutex> lock{mutex_};
 
-  return file;
+  auto it = ids_.find(name);
+  return it == ids_.end() ? kMissing : it->second;
 }
 
-void FileOrDirectory::Add(const FileOrDirectory &file) {
-  files_->push_back(file);
-}
+NameId NameTable::Intern(const std::string &name) {
+  auto id = Find(name);
+  if (id != kMissing) {
+    return id;
+  }
 
-void FileOrDirectory::SetPermission(unsigned char p) {
-  permission_ = 0;
-  permission_ |= p;
-}
+  std::unique_lock<std::shared_mutex> lock{mutex_};
 
-std::string FileOrDirectory::Name() const {
-  return name_;
-}
+  auto it = ids_.find(name);
+  if (it != ids_.end()) {
+    return it->second;
+  }
 
-bool FileOrDirectory::Readable() const {
-  return (permission_ & READ_FLAG) == READ_FLAG;
-}
+  id = size_;
+  auto chunk_index = id >> kChunkBits;
+  if (chunk_index >= kMaxChunks) {
+    throw std::length_error{"name table is full"};
+  }
 
-bool FileOrDirectory::Writeable() const {
-  return (permission_ & WRITE_FLAG) == WRITE_FLAG;
-}
+  auto *chunk = chunks_[chunk_index].load(std::memory_order_relaxed);
+  if (chunk == nullptr) {
+    chunk = new std::string[kChunkSize];
+    chunks_[chunk_index].store(chunk, std::memory_order_release);
+  }
 
-bool FileOrDirectory::Executable() const {
-  return (permission_ & EXECUTE_FLAG) == EXECUTE_FLAG;
+  auto &slot = chunk[id & (kChunkSize - 1)];
+  slot = name;
+  ids_.emplace(std::string_view{slot}, id);
+  size_++;
+
+  return id;
 }
 
-bool FileOrDirectory::IsDirectory() const {
-  return is_directory_;
+std::size_t NameTable::Size() const {
+  std::shared_lock<std::shared_mutex> lock{mutex_};
+  return size_;
 }
 
-std::shared_ptr<std::vector<FileOrDirectory>> FileOrDirectory::Files() const {
-  return files_;
+const std::string &NameTable::String(NameId id) const {
+  return chunks_[id >> kChunkBits].load(std::memory_order_acquire)[id & (kChunkSize - 1)];
 }
 
-class FileSystem {
+class PrefixIndex {
 public:
-  void for_dev_populate();
-
-  void Add(const FileOrDirectory &);
-
-  void TraverseDirectory(const std::vector<std::string> &, const std::function<void(std::shared_ptr<std::vector<FileOrDirectory>>)> &func);
+  void Insert(NameId);
+  void Erase(NameId);
 
-  std::shared_ptr<std::vector<FileOrDirectory>> Root() {
-    return root_;
-  }
+  Completion Complete(const std::string &, std::size_t) const;
 
 private:
-  std::shared_ptr<std::vector<FileOrDirectory>> root_;
-};
+  struct NameOrder {
+    using is_transparent = void;
 
-void FileSystem::for_dev_populate() {
-  auto tmp = FileOrDirectory::CreateDirectory("tmp");
-  tmp.Add(FileOrDirectory::CreateFile("file.txt"));
-  tmp.Add(FileOrDirectory::CreateFile("file2.txt"));
+    bool operator()(NameId a, NameId b) const {
+      return a != b && NameTable::Global().String(a) < NameTable::Global().String(b);
+    }
 
-  auto sys = FileOrDirectory::CreateDirectory("sys");
+    bool operator()(NameId a, const std::string &b) const {
+      return NameTable::Global().String(a) < b;
+    }
 
-  auto usr = FileOrDirectory::CreateDirectory("usr");
-  usr.Add(FileOrDirectory::CreateDirectory("bin"));
+    bool operator()(const std::string &a, NameId b) const {
+      return a < NameTable::Global().String(b);
+    }
+  };
+
+  std::multiset<NameId, NameOrder> names_;
+};
 
-  root_ = std::make_shared<std::vector<FileOrDirectory>>();
-  root_->push_back(tmp);
-  root_->push_back(sys);
-  root_->push_back(usr);
-  root_->push_back(FileOrDirectory::CreateFile("log.txt"));
+void PrefixIndex::Insert(NameId name) {
+  names_.insert(name);
 }
 
-void FileSystem::Add(const FileOrDirectory &file) {
-  root_->push_back(file);
+void PrefixIndex::Erase(NameId name) {
+  auto it = names_.find(name);
+  if (it != names_.end()) {
+    names_.erase(it);
+  }
 }
 
-void FileSystem::TraverseDirectory(const std::vector<std::string> &cwd, const std::function<void(std::shared_ptr<std::vector<FileOrDirectory>>)> &func) {
-  if (cwd.size() == 1) {
-    func(root_);
-    return;
+Completion PrefixIndex::Complete(const std::string &prefix, std::size_t limit) const {
+  Completion completion;
+
+  const auto &table = NameTable::Global();
+
+  auto first = names_.lower_bound(prefix);
+  if (first == names_.end() || table.String(*first).compare(0, prefix.size(), prefix) != 0) {
+    return completion;
   }
 
-  auto files = root_;
+  // Everything sharing the prefix sorts before the prefix with its last
+  // byte bumped, so the matching range is found with two O(log n) probes.
+  auto upper = prefix;
+  while (!upper.empty() && static_cast<unsigned char>(upper.back()) == 0xFF) {
+    upper.pop_back();
+  }
 
-  for (std::size_t i = 1; i < cwd.size(); i++) {
-    for (const auto &f : *files) { 
-      if (f.IsDirectory() && f.Name() == cwd[i]) {
-        files = f.Files();
-      }
+  auto last = names_.end();
+  if (!upper.empty()) {
+    upper.back()++;
+    last = names_.lower_bound(upper);
+  }
+
+  const auto &low = table.String(*first);
+  const auto &high = table.String(*std::prev(last));
+  std::size_t common = 0;
+  while (common < low.size() && common < high.size() && low[common] == high[common]) {
+    common++;
+  }
+  completion.common_prefix = low.substr(0, common);
+
+  NameId previous = NameTable::kMissing;
+  for (auto it = first; it != last; it++) {
+    if (*it == previous) {
+      continue;
+    }
+    previous = *it;
+
+    if (completion.candidates.size() == limit) {
+      completion.truncated = true;
+      break;
     }
+
+    completion.candidates.push_back(table.String(*it));
   }
 
-  func(files);
+  return completion;
 }
 
-class Command {
+class BlockDevice {
 public:
-  virtual void Execute(Shell&) = 0;
-};
+  static constexpr std::size_t kBlockSize = 4096;
 
+  struct Extent {
+    std::uint64_t start;
+    unsigned char order;
+  };
 
+  explicit BlockDevice(std::uint64_t);
 
-class Shell {
-public:
-  Shell(const Computer &);
+  bool Allocate(std::uint64_t, std::vector<Extent> &);
+  void Release(const Extent &);
 
-  void MainLoop();
+  void Read(std::uint64_t, char *) const;
+  void Write(std::uint64_t, const char *);
+  const char *Data(std::uint64_t) const;
+  void ForEachWritten(const Extent &, const std::function<void(std::uint64_t)> &) const;
 
-  void SetDateTime(const std::chrono::time_point<std::chrono::system_clock> &);
+  std::uint64_t BlockCount() const;
+  std::uint64_t FreeBlocks() const;
+  std::size_t FreeExtents() const;
+  std::uint64_t LargestFreeExtent() const;
 
-  void DisplayPrompt();
+  std::vector<std::string> Check(std::vector<Extent>) const;
 
-  bool IsAuthenticating();
+private:
+  bool AllocateOrder(unsigned char, std::uint64_t &);
 
-  void Shutdown();
+private:
+  std::uint64_t block_count_;
+  std::uint64_t free_blocks_{0};
 
-  void Go(const std::string &);
-  void Back();
+  // Buddy free lists, one per power-of-two extent size. Sets keep the
+  // lowest addresses in use first, which keeps files packed together.
+  std::vector<std::set<std::uint64_t>> free_lists_;
 
-  std::vector<std::string> Cwd() {
-    return cwd_;
+  // Only blocks that were ever written hold memory.
+  std::map<std::uint64_t, std::unique_ptr<char[]>> blocks_;
+};
+
+BlockDevice::BlockDevice(std::uint64_t capacity) : block_count_{capacity / kBlockSize} {
+  unsigned char max_order = 0;
+  while ((std::uint64_t{2} << max_order) <= block_count_) {
+    max_order++;
   }
+  free_lists_.resize(max_order + 1);
+
+  std::uint64_t position = 0;
+  for (int order = max_order; order >= 0; order--) {
+    auto size = std::uint64_t{1} << order;
+    if (block_count_ - position >= size) {
+      free_lists_[order].insert(position);
+      position += size;
+    }
+  }
+  free_blocks_ = position;
+}
 
-  Argument Arg() const;
-  User CurrentUser() const;
-  std::chrono::time_point<std::chrono::system_clock> DateTime() const;
-  Computer GetComputer() const;
+bool BlockDevice::AllocateOrder(unsigned char order, std::uint64_t &start) {
+  auto available = order;
+  while (available < free_lists_.size() && free_lists_[available].empty()) {
+    available++;
+  }
 
-private:
-  Shell();
+  if (available >= free_lists_.size()) {
+    return false;
+  }
 
-  std::vector<std::string> Tokenize(std::string);
-  void ParseArgs(const std::vector<std::string> &);
-  bool ContainsCommand(const std::string &);
+  auto &list = free_lists_[available];
+  start = *list.begin();
+  list.erase(list.begin());
 
-  bool IsRunning() const;
+  while (available > order) {
+    available--;
+    free_lists_[available].insert(start + (std::uint64_t{1} << available));
+  }
 
-private:
-  std::vector<User> users_;
-  User current_user_;
+  free_blocks_ -= std::uint64_t{1} << order;
+  return true;
+}
 
-  std::vector<std::string> cwd_;
+bool BlockDevice::Allocate(std::uint64_t count, std::vector<Extent> &extents) {
+  if (count > free_blocks_) {
+    return false;
+  }
 
-  bool is_running_;
-  std::unordered_map<std::string, std::unique_ptr<Command>> commands_;
-  Argument arg_;
+  // The request is carved into its binary digits, largest first; a digit
+  // the free lists cannot serve whole is split into two halves, so the
+  // allocation succeeds whenever enough blocks are free at all.
+  std::vector<unsigned char> pending;
+  for (int order = static_cast<int>(free_lists_.size()) - 1; order >= 0; order--) {
+    if (count & (std::uint64_t{1} << order)) {
+      pending.push_back(static_cast<unsigned char>(order));
+    }
+  }
+  std::reverse(pending.begin(), pending.end());
 
-  Computer computer_;
-};
+  while (!pending.empty()) {
+    auto order = pending.back();
+    pending.pop_back();
 
-Computer Shell::GetComputer() const {
-  return computer_;
-}
+    std::uint64_t start;
+    if (AllocateOrder(order, start)) {
+      extents.push_back({start, order});
+    } else {
+      pending.push_back(order - 1);
+      pending.push_back(order - 1);
+    }
+  }
 
-void Shell::Go(const std::string &path) {
-  cwd_.push_back(path);
+  return true;
 }
 
-void Shell::Back() {
-  cwd_.pop_back();
-}
+void BlockDevice::Release(const Extent &extent) {
+  auto start = extent.start;
+  auto order = extent.order;
 
-void Shell::DisplayPrompt() {
-  std::cout << current_user_.Login() << '@' << "desktop:";
-  for (std::size_t i = 0; i < cwd_.size(); i++) {
-    if (i == 0 || i == cwd_.size() - 1) {
-      std::cout << cwd_[i];
-    } else {
-      std::cout << cwd_[i] << '/';
+  blocks_.erase(blocks_.lower_bound(start), blocks_.lower_bound(start + (std::uint64_t{1} << order)));
+  free_blocks_ += std::uint64_t{1} << order;
+
+  while (order + 1u < free_lists_.size()) {
+    auto buddy = start ^ (std::uint64_t{1} << order);
+    auto it = free_lists_[order].find(buddy);
+    if (it == free_lists_[order].end()) {
+      break;
     }
+
+    free_lists_[order].erase(it);
+    start = std::min(start, buddy);
+    order++;
   }
 
-  std::cout << "$ ";
+  free_lists_[order].insert(start);
 }
 
-void Shell::SetDateTime(const std::chrono::time_point<std::chrono::system_clock> &time_point) {
-  computer_.SetDateTime(time_point);
+void BlockDevice::Read(std::uint64_t block, char *out) const {
+  auto it = blocks_.find(block);
+  if (it == blocks_.end()) {
+    std::fill(out, out + kBlockSize, '\0');
+    return;
+  }
+
+  std::copy(it->second.get(), it->second.get() + kBlockSize, out);
 }
 
-std::chrono::time_point<std::chrono::system_clock> Shell::DateTime() const {
-  return computer_.TimePoint();
+void BlockDevice::Write(std::uint64_t block, const char *in) {
+  auto &data = blocks_[block];
+  if (!data) {
+    data = std::make_unique<char[]>(kBlockSize);
+  }
+
+  std::copy(in, in + kBlockSize, data.get());
 }
 
-User Shell::CurrentUser() const {
-  return current_user_;
+const char *BlockDevice::Data(std::uint64_t block) const {
+  auto it = blocks_.find(block);
+  return it == blocks_.end() ? nullptr : it->second.get();
 }
 
-bool Shell::IsAuthenticating() {
-  std::string login;
-  std::string password;
+void BlockDevice::ForEachWritten(const Extent &extent, const std::function<void(std::uint64_t)> &func) const {
+  auto end = blocks_.lower_bound(extent.start + (std::uint64_t{1} << extent.order));
+  for (auto it = blocks_.lower_bound(extent.start); it != end; it++) {
+    func(it->first);
+  }
+}
 
-  std::cout << "login: ";
-  std::getline(std::cin, login);
+std::uint64_t BlockDevice::BlockCount() const {
+  return block_count_;
+}
 
-  std::cout << "password: ";
-  std::getline(std::cin, password);
+std::uint64_t BlockDevice::FreeBlocks() const {
+  return free_blocks_;
+}
 
-  for (const auto &user : users_) {
-    if (user.Login() == login && user.Password() == password) {
-      current_user_ = user;
-      return true;
-    }
+std::size_t BlockDevice::FreeExtents() const {
+  std::size_t count = 0;
+  for (const auto &list : free_lists_) {
+    count += list.size();
   }
 
-  std::cout << "invalid login\n";
-  return false;
+  return count;
 }
 
-class ShutdownCommand : public Command {
-public:
-  virtual void Execute(Shell &);
-};
+std::uint64_t BlockDevice::LargestFreeExtent() const {
+  for (auto order = free_lists_.size(); order > 0; order--) {
+    if (!free_lists_[order - 1].empty()) {
+      return std::uint64_t{1} << (order - 1);
+    }
+  }
 
-class ChangeDirectoryCommand : public Command {
-public:
-  ChangeDirectoryCommand(const std::shared_ptr<FileSystem> &);
+  return 0;
+}
 
-  virtual void Execute(Shell &);
+// Takes every extent handed out and not released. Together with the free
+// lists they must tile the device exactly; free extents must be aligned,
+// fully coalesced and hold no written blocks.
+std::vector<std::string> BlockDevice::Check(std::vector<Extent> in_use) const {
+  std::vector<std::string> problems;
+  auto describe = [](const Extent &extent) {
+    return std::to_string(extent.start) + "+" + std::to_string(std::uint64_t{1} << extent.order);
+  };
 
-private:
- std::shared_ptr<FileSystem> fs_;
-};
+  std::uint64_t free_blocks = 0;
+  auto extents = std::move(in_use);
+  for (std::size_t order = 0; order < free_lists_.size(); order++) {
+    auto size = std::uint64_t{1} << order;
+    for (auto start : free_lists_[order]) {
+      Extent extent{start, static_cast<unsigned char>(order)};
+      free_blocks += size;
 
-ChangeDirectoryCommand::ChangeDirectoryCommand(const std::shared_ptr<FileSystem> &fs) : fs_{fs} {}
+      if (start % size != 0) {
+        problems.push_back("free extent " + describe(extent) + " is misaligned");
+      }
+      if (order + 1 < free_lists_.size() && free_lists_[order].count(start ^ size) != 0 && start < (start ^ size)) {
+        problems.push_back("free extent " + describe(extent) + " was not merged with its buddy");
+      }
 
-void ChangeDirectoryCommand::Execute(Shell &shell) {
-  auto arg = shell.Arg();
+      auto written = blocks_.lower_bound(start);
+      if (written != blocks_.end() && written->first < start + size) {
+        problems.push_back("free extent " + describe(extent) + " holds written block " +
+                           std::to_string(written->first));
+      }
+      extents.push_back(extent);
+    }
+  }
 
-  if (!arg.HasParameters()) {
-    std::cout << arg.ProgramName() << ": missing operand\n";
-    return;
+  if (free_blocks != free_blocks_) {
+    problems.push_back("free lists hold " + std::to_string(free_blocks) + " blocks, counter says " +
+                       std::to_string(free_blocks_));
   }
 
-  auto parameters = arg.Parameters();
-  auto target = parameters[0];
+  std::sort(extents.begin(), extents.end(), [](const Extent &a, const Extent &b) {
+    return a.start < b.start;
+  });
 
-  if (target == "..") {
-    if (shell.Cwd().size() == 1) {
-      return;
+  std::uint64_t position = 0;
+  for (const auto &extent : extents) {
+    if (extent.start < position) {
+      problems.push_back("extent " + describe(extent) + " overlaps the one before it");
+    } else if (extent.start > position) {
+      problems.push_back("blocks " + std::to_string(position) + "-" + std::to_string(extent.start - 1) +
+                         " are neither free nor in use");
     }
-
-    shell.Back();
-    return;
+    position = std::max(position, extent.start + (std::uint64_t{1} << extent.order));
   }
 
-  bool is_exists = false;
-
-  fs_->TraverseDirectory(shell.Cwd(), [&](std::shared_ptr<std::vector<FileOrDirectory>> files) {
-    for (const auto &file : *files) {
-      if (file.IsDirectory() && file.Name() == target) {
-        is_exists = true; 
-        return;
-      }
-    } 
-  });
-
-  if (!is_exists) {
-    std::cout << arg.ProgramName() << ": no such file or directory\n";
-    return;
+  if (position != block_count_) {
+    problems.push_back("extents end at block " + std::to_string(position) + " of " + std::to_string(block_count_));
   }
 
-  shell.Go(target);
+  return problems;
 }
 
-class DateCommand : public Command {
-public:
-  virtual void Execute(Shell &);
+struct FileData {
+  std::uint64_t size{0};
+  std::vector<BlockDevice::Extent> extents;
+
+  std::uint64_t Blocks() const {
+    std::uint64_t blocks = 0;
+    for (const auto &extent : extents) {
+      blocks += std::uint64_t{1} << extent.order;
+    }
+    return blocks;
+  }
 };
 
-class ListCommand : public Command {
+class PageCache {
 public:
-  ListCommand(const std::shared_ptr<FileSystem> &);
+  struct Counters {
+    std::uint64_t hits{0};
+    std::uint64_t misses{0};
+    std::uint64_t read_ahead{0};
+    std::uint64_t evictions{0};
+    std::uint64_t write_backs{0};
+  };
 
-  virtual void Execute(Shell &);
+  PageCache(BlockDevice &, std::size_t);
 
-private:
-  std::shared_ptr<FileSystem> fs_;
-};
+  void Read(std::uint64_t, char *);
+  void Write(std::uint64_t, const char *);
+  void ReadAhead(std::uint64_t, std::size_t);
 
-class RemoveCommand : public Command {
-public:
-  RemoveCommand(const std::shared_ptr<FileSystem> &);
+  void Discard(const BlockDevice::Extent &);
+  void Flush();
+  void Clear();
 
-  virtual void Execute(Shell &);
+  std::size_t Capacity() const;
+  std::size_t Size() const;
+  std::size_t DirtyPages() const;
+  const Counters &GetCounters() const;
 
 private:
-  std::shared_ptr<FileSystem> fs_;
-};
-
-RemoveCommand::RemoveCommand(const std::shared_ptr<FileSystem> &fs) : fs_{fs} {}
+  enum class Queue {
+    kIn,
+    kOut,
+    kMain,
+  };
 
-ListCommand::ListCommand(const std::shared_ptr<FileSystem> &fs) : fs_{fs} {}
+  struct Page {
+    std::uint64_t block;
+    // Null until the page holds something other than zeroes, so reading
+    // through sparse files costs no page memory.
+    std::unique_ptr<char[]> data;
+    bool is_dirty{false};
+    bool is_referenced{false};
+  };
 
-class ChangeModeCommand : public Command {
-public:
-  ChangeModeCommand(const std::shared_ptr<FileSystem> &);
+  struct Slot {
+    Queue queue;
+    std::list<Page>::iterator page;
+    std::list<std::uint64_t>::iterator ghost;
+  };
 
-  virtual void Execute(Shell &);
+  Page &Fetch(std::uint64_t, bool);
+  void Insert(Page &&, bool);
+  void Reclaim();
+  void Drop(std::unordered_map<std::uint64_t, Slot>::iterator);
 
 private:
-  std::shared_ptr<FileSystem> fs_;
+  BlockDevice &device_;
+
+  // 2Q: pages seen once wait in a FIFO and are evicted from there first,
+  // so a single large scan cannot flush pages that were used repeatedly.
+  // A page read again while in the FIFO moves to the LRU, and so does a
+  // miss on a block recently evicted from the FIFO (a ghost). Prefetched
+  // and freshly written pages start unreferenced, so a sequential cat or
+  // write passes through the FIFO only once.
+  std::size_t capacity_;
+  std::size_t in_limit_;
+  std::size_t out_limit_;
+
+  std::list<Page> in_;
+  std::list<Page> main_;
+  std::list<std::uint64_t> out_;
+  std::unordered_map<std::uint64_t, Slot> slots_;
+
+  std::size_t dirty_pages_{0};
+  Counters counters_;
 };
 
-ChangeModeCommand::ChangeModeCommand(const std::shared_ptr<FileSystem> &fs) : fs_{fs} {}
+PageCache::PageCache(BlockDevice &device, std::size_t capacity)
+  : device_{device}, capacity_{std::max<std::size_t>(capacity, 2)},
+    in_limit_{std::max<std::size_t>(capacity_ / 4, 1)}, out_limit_{std::max<std::size_t>(capacity_ / 2, 1)} {}
 
-void ChangeModeCommand::Execute(Shell &shell) {
-  auto arg = shell.Arg();
-  auto parameters = arg.Parameters();
+void PageCache::Read(std::uint64_t block, char *out) {
+  const auto &page = Fetch(block, true);
+  if (page.data) {
+    std::copy(page.data.get(), page.data.get() + BlockDevice::kBlockSize, out);
+  } else {
+    std::fill(out, out + BlockDevice::kBlockSize, '\0');
+  }
+}
 
-  if (parameters.size() < 2) {
-    std::cout << arg.ProgramName() << ": not enough parameter\n";
-    return;
+void PageCache::Write(std::uint64_t block, const char *in) {
+  auto &page = Fetch(block, false);
+  if (!page.data) {
+    page.data = std::make_unique<char[]>(BlockDevice::kBlockSize);
   }
+  std::copy(in, in + BlockDevice::kBlockSize, page.data.get());
 
-  auto mode = std::stoi(parameters[0]);
-  auto target = parameters[1];
+  if (!page.is_dirty) {
+    page.is_dirty = true;
+    dirty_pages_++;
+  }
+}
 
-  if (mode < 0 && mode > 7) {
-    return;
+void PageCache::ReadAhead(std::uint64_t block, std::size_t count) {
+  for (auto end = block + count; block < end; block++) {
+    auto it = slots_.find(block);
+    if (it != slots_.end() && it->second.queue != Queue::kOut) {
+      continue;
+    }
+
+    // A ghost being read back in is a refault of a block that was reused,
+    // so it is promoted just as a demand miss would be.
+    Page page{block, nullptr};
+    if (const auto *data = device_.Data(block)) {
+      page.data = std::make_unique<char[]>(BlockDevice::kBlockSize);
+      std::copy(data, data + BlockDevice::kBlockSize, page.data.get());
+    }
+    Insert(std::move(page), it != slots_.end());
+    counters_.read_ahead++;
   }
+}
 
-  fs_->TraverseDirectory(shell.Cwd(), [&](std::shared_ptr<std::vector<FileOrDirectory>> files) {
-    for (auto &file : *files) {
-      if (file.Name() == target) {
-        file.SetPermission(mode);
-        return;
-      }
+PageCache::Page &PageCache::Fetch(std::uint64_t block, bool is_read) {
+  auto it = slots_.find(block);
+  if (it != slots_.end() && it->second.queue != Queue::kOut) {
+    if (is_read) {
+      counters_.hits++;
     }
-    std::cout << arg.ProgramName() << ": target not found\n";
-  });
+
+    auto &slot = it->second;
+    if (slot.queue == Queue::kMain) {
+      main_.splice(main_.begin(), main_, slot.page);
+    } else if (is_read && slot.page->is_referenced) {
+      main_.splice(main_.begin(), in_, slot.page);
+      slot.queue = Queue::kMain;
+    } else if (is_read) {
+      slot.page->is_referenced = true;
+    }
+    return *slot.page;
+  }
+
+  // Whole-block writes replace the content, so there is nothing to fetch.
+  Page page{block, nullptr};
+  page.is_referenced = is_read;
+  if (is_read) {
+    counters_.misses++;
+    if (const auto *data = device_.Data(block)) {
+      page.data = std::make_unique<char[]>(BlockDevice::kBlockSize);
+      std::copy(data, data + BlockDevice::kBlockSize, page.data.get());
+    }
+  }
+
+  Insert(std::move(page), it != slots_.end());
+  return *slots_[block].page;
 }
 
-void DateCommand::Execute(Shell &shell) {
-  auto arg = shell.Arg();
+void PageCache::Insert(Page &&page, bool is_ghost) {
+  auto block = page.block;
+  if (is_ghost) {
+    auto it = slots_.find(block);
+    out_.erase(it->second.ghost);
+    slots_.erase(it);
+  }
 
-  if (!arg.HasParameters()) {
-    auto tp = std::chrono::system_clock::to_time_t(shell.DateTime());
-    std::cout << std::ctime(&tp);
-    return;
+  while (in_.size() + main_.size() >= capacity_) {
+    Reclaim();
   }
 
-  auto parameters = arg.Parameters();
+  auto &queue = is_ghost ? main_ : in_;
+  queue.push_front(std::move(page));
+  slots_[block] = {is_ghost ? Queue::kMain : Queue::kIn, queue.begin(), {}};
+}
 
-  if (parameters.size() < 2) {
-    std::cout << arg.ProgramName() << ": not enough parameter\n";
+void PageCache::Reclaim() {
+  bool is_first_timer = in_.size() > in_limit_ || main_.empty();
+  auto &queue = is_first_timer ? in_ : main_;
+  auto &victim = queue.back();
+
+  if (victim.is_dirty) {
+    device_.Write(victim.block, victim.data.get());
+    dirty_pages_--;
+    counters_.write_backs++;
+  }
+  counters_.evictions++;
+
+  auto block = victim.block;
+  queue.pop_back();
+
+  if (!is_first_timer) {
+    slots_.erase(block);
     return;
   }
 
-  auto format = parameters[0];
-  auto datetime = parameters[1];
+  out_.push_front(block);
+  auto &slot = slots_[block];
+  slot.queue = Queue::kOut;
+  slot.ghost = out_.begin();
 
-  std::stringstream datetime_stream{datetime};
+  if (out_.size() > out_limit_) {
+    slots_.erase(out_.back());
+    out_.pop_back();
+  }
+}
 
-  std::tm tm{};
-  datetime_stream >> std::get_time(&tm, format.c_str());
+void PageCache::Drop(std::unordered_map<std::uint64_t, Slot>::iterator it) {
+  auto &slot = it->second;
+  if (slot.queue == Queue::kOut) {
+    out_.erase(slot.ghost);
+  } else {
+    dirty_pages_ -= slot.page->is_dirty ? 1 : 0;
+    (slot.queue == Queue::kIn ? in_ : main_).erase(slot.page);
+  }
+  slots_.erase(it);
+}
 
-  if (datetime_stream.fail()) {
-    std::cout << arg.ProgramName() << ": failed to change date\n";
+void PageCache::Discard(const BlockDevice::Extent &extent) {
+  // Freed blocks must not be written back over whatever is allocated there
+  // next, so their pages go without a flush.
+  auto begin = extent.start;
+  auto end = extent.start + (std::uint64_t{1} << extent.order);
+
+  if (end - begin > slots_.size()) {
+    for (auto it = slots_.begin(); it != slots_.end();) {
+      auto current = it++;
+      if (current->first >= begin && current->first < end) {
+        Drop(current);
+      }
+    }
     return;
   }
 
-  auto tp = std::chrono::system_clock::from_time_t(std::mktime(&tm));
-  shell.SetDateTime(tp);
+  for (auto block = begin; block < end; block++) {
+    auto it = slots_.find(block);
+    if (it != slots_.end()) {
+      Drop(it);
+    }
+  }
 }
 
-class MakeDirectoryCommand : public Command {
+void PageCache::Flush() {
+  for (auto *queue : {&in_, &main_}) {
+    for (auto &page : *queue) {
+      if (page.is_dirty) {
+        device_.Write(page.block, page.data.get());
+        page.is_dirty = false;
+        counters_.write_backs++;
+      }
+    }
+  }
+  dirty_pages_ = 0;
+}
+
+void PageCache::Clear() {
+  in_.clear();
+  main_.clear();
+  out_.clear();
+  slots_.clear();
+  dirty_pages_ = 0;
+}
+
+std::size_t PageCache::Capacity() const {
+  return capacity_;
+}
+
+std::size_t PageCache::Size() const {
+  return in_.size() + main_.size();
+}
+
+std::size_t PageCache::DirtyPages() const {
+  return dirty_pages_;
+}
+
+const PageCache::Counters &PageCache::GetCounters() const {
+  return counters_;
+}
+
+class Directory;
+
+class FileOrDirectory {
 public:
-  MakeDirectoryCommand(const std::shared_ptr<FileSystem> &);
 
-  virtual void Execute(Shell &);
+  static FileOrDirectory CreateDirectory(const std::string &);
+
+  static FileOrDirectory CreateFile(const std::string &);
+
+  void Add(const FileOrDirectory &);
+  void SetPermission(unsigned char);
+
+  const std::string &Name() const;
+  NameId Key() const;
+  unsigned char Permission() const;
+  bool Readable() const;
+  bool Writeable() const;
+  bool Executable() const;
+
+  bool IsDirectory() const;
+
+  std::shared_ptr<Directory> Files() const;
+
+  std::uint64_t Size() const;
+  std::shared_ptr<FileData> Data() const;
+  void SetData(const std::shared_ptr<FileData> &);
 
 private:
-  std::shared_ptr<FileSystem> fs_;
+  FileOrDirectory(const std::string &, bool, const std::shared_ptr<Directory> &);
+
+private:
+  std::shared_ptr<Directory> files_;
+  std::shared_ptr<FileData> data_;
+
+  NameId name_;
+  bool is_directory_;
+
+  unsigned char permission_{0};
 };
 
-MakeDirectoryCommand::MakeDirectoryCommand(const std::shared_ptr<FileSystem> &fs) : fs_{fs} {}
+struct Usage {
+  std::uint64_t entries{0};
+  std::uint64_t files{0};
+  std::uint64_t directories{0};
+  std::uint64_t bytes{0};
+
+  Usage &operator+=(const Usage &other) {
+    entries += other.entries;
+    files += other.files;
+    directories += other.directories;
+    bytes += other.bytes;
+    return *this;
+  }
 
-class ClearCommand : public Command {
+  Usage &operator-=(const Usage &other) {
+    entries -= other.entries;
+    files -= other.files;
+    directories -= other.directories;
+    bytes -= other.bytes;
+    return *this;
+  }
+
+  bool operator==(const Usage &other) const {
+    return entries == other.entries && files == other.files &&
+           directories == other.directories && bytes == other.bytes;
+  }
+};
+
+// The live part of a directory's entries. Erasing near the front leaves
+// vacant slots ahead of it instead of moving everything behind.
+template <typename Iterator>
+class EntryRange {
 public:
-  virtual void Execute(Shell &);
+  EntryRange(Iterator begin, Iterator end) : begin_{begin}, end_{end} {}
+
+  Iterator begin() const { return begin_; }
+  Iterator end() const { return end_; }
+  std::size_t size() const { return end_ - begin_; }
+  bool empty() const { return begin_ == end_; }
+  decltype(auto) operator[](std::size_t i) const { return begin_[i]; }
+
+private:
+  Iterator begin_;
+  Iterator end_;
 };
 
-void ShutdownCommand::Execute(Shell &shell) {
-  shell.Shutdown();
-}
+class Directory {
+public:
+  void Add(const FileOrDirectory &);
+  void Erase(std::vector<FileOrDirectory>::iterator);
+  void Clear();
 
-void ListCommand::Execute(Shell &shell) {
-  auto arg = shell.Arg();
+  std::vector<FileOrDirectory>::iterator Find(NameId);
 
-  bool should_detail = false;
-  if (arg.HasOptions()) {
-    auto options = arg.Options();
+  EntryRange<std::vector<FileOrDirectory>::iterator> Entries();
+  EntryRange<std::vector<FileOrDirectory>::const_iterator> Entries() const;
+  const PrefixIndex &Index() const;
 
-    for (const auto &option : options) {
-      if (option == "-l") {
-        should_detail = true;
-      }
-    }
-  }
+  const Directory *Parent() const;
+  NameId Key() const;
 
-  fs_->TraverseDirectory(shell.Cwd(), [&](std::shared_ptr<std::vector<FileOrDirectory>> files) {
-    if (should_detail) {
-      std::cout << "total " << files->size() << '\n';
-      for (const auto &f : *files) {
-        if (f.IsDirectory()) {
-          std::cout << 'd';
-        } else {
-          std::cout << '-';
-        }
+  const Usage &Totals() const;
+  static Usage UsageOf(const FileOrDirectory &);
 
-        if (f.Readable()) {
-          std::cout << 'r';
-        } else {
-          std::cout << '-';
-        }
+  void Propagate(const Usage &, bool);
 
-        if (f.Writeable()) {
-          std::cout << 'w';
-        } else {
-          std::cout << '-';
-        }
+private:
+  void BuildLookup();
 
-        if (f.Executable()) {
-          std::cout << 'x';
-        } else {
-          std::cout << '-';
-        }
+private:
+  // Large directories also map each name to the sequence number it was
+  // added under. sequences parallels entries_ slot for slot in the same
+  // ascending order, so an entry is found by binary search and erasing one
+  // leaves every other mapping valid. Small directories are scanned instead.
+  struct Lookup {
+    std::unordered_map<NameId, std::uint64_t> names;
+    std::vector<std::uint64_t> sequences;
+    std::uint64_t next{0};
+  };
 
-        std::cout << " " << f.Name() << '\n';
-      }     
-    } else {
-      for (const auto &f : *files) {
-        std::cout << f.Name() << ' ';
-      }
-    }
+  static constexpr std::size_t kLookupMinimum = 64;
 
-    if (!should_detail) {
-      std::cout << '\n';
-    }
-  });
-}
+  std::vector<FileOrDirectory> entries_;
+  PrefixIndex index_;
+  std::unique_ptr<Lookup> lookup_;
 
-void RemoveCommand::Execute(Shell &shell) {
-  auto arg = shell.Arg();
+  Directory *parent_{nullptr};
+  NameId name_{NameTable::kMissing};
+  std::uint32_t head_{0};
 
-  if (!arg.HasParameters()) {
-    std::cout << arg.ProgramName() << ": missing operand\n";
-    return;
+  // Everything below this directory, kept current on every Add/Erase so
+  // that subtree totals never need a walk.
+  Usage totals_;
+};
+
+void Directory::Add(const FileOrDirectory &file) {
+  if (file.IsDirectory()) {
+    auto directory = file.Files();
+    directory->parent_ = this;
+    directory->name_ = file.Key();
   }
 
-  fs_->TraverseDirectory(shell.Cwd(), [&](std::shared_ptr<std::vector<FileOrDirectory>> files) {
-    bool is_exists = false;
+  entries_.push_back(file);
+  index_.Insert(file.Key());
 
-    for (const auto &parameter : arg.Parameters()) {
-      auto it = files->begin();
-      for (; it != files->end(); it++) {
-        if (!it->IsDirectory() && it->Name() == parameter) {
-          is_exists = true; 
-          break;
-        }
-      }
-      
-      if (is_exists) {
-        files->erase(it);
-        is_exists = false;
-      }
-    }
-  });
+  if (lookup_) {
+    lookup_->names[file.Key()] = lookup_->next;
+    lookup_->sequences.push_back(lookup_->next++);
+  } else if (entries_.size() - head_ >= kLookupMinimum) {
+    BuildLookup();
+  }
+
+  Propagate(UsageOf(file), true);
 }
 
-void MakeDirectoryCommand::Execute(Shell &shell) {
-  auto arg = shell.Arg();
+void Directory::Erase(std::vector<FileOrDirectory>::iterator it) {
+  auto usage = UsageOf(*it);
 
-  if (!arg.HasParameters()) {
-    std::cout << arg.ProgramName() << ": missing operand\n";
-    return;
+  auto position = it - entries_.begin();
+  if (lookup_) {
+    auto found = lookup_->names.find(it->Key());
+    if (found != lookup_->names.end() && found->second == lookup_->sequences[position]) {
+      lookup_->names.erase(found);
+    }
   }
 
-  fs_->TraverseDirectory(shell.Cwd(), [&](std::shared_ptr<std::vector<FileOrDirectory>> files) {
-    bool is_exists = false;
+  index_.Erase(it->Key());
 
-    for (const auto &parameter : arg.Parameters()) {
-      for(const auto &file : *files) {
-        if (file.IsDirectory() && file.Name() == parameter) {
-          std::cout << arg.ProgramName() << ": directory exists\n";
-          is_exists = true;
-        }
-      }
+  // Whichever side of the entry is shorter moves into its slot, so taking
+  // entries off either end stays cheap and the order is kept.
+  if (position - head_ < entries_.end() - it) {
+    std::move_backward(entries_.begin() + head_, it, it + 1);
+    if (lookup_) {
+      auto &sequences = lookup_->sequences;
+      std::move_backward(sequences.begin() + head_, sequences.begin() + position, sequences.begin() + position + 1);
+    }
+    head_++;
+  } else {
+    entries_.erase(it);
+    if (lookup_) {
+      lookup_->sequences.erase(lookup_->sequences.begin() + position);
+    }
+  }
 
-      if (!is_exists) {
-        files->push_back(FileOrDirectory::CreateDirectory(parameter));
-      }
-      is_exists = false;
+  auto live = entries_.size() - head_;
+  if (head_ > live) {
+    entries_.erase(entries_.begin(), entries_.begin() + head_);
+    if (lookup_) {
+      lookup_->sequences.erase(lookup_->sequences.begin(), lookup_->sequences.begin() + head_);
     }
-  });
-}
+    head_ = 0;
+  }
 
-void ClearCommand::Execute(Shell &shell) {
-#if defined(_WIN32)
-  std::system("cls");
-#else
-  std::system("clear");
-#endif
+  if (lookup_ && live < kLookupMinimum / 2) {
+    lookup_.reset();
+  }
+
+  Propagate(usage, false);
 }
 
-void Shell::MainLoop() {
-  while (!IsAuthenticating()) {}
+// Empties a directory that is being torn down; its totals are left alone
+// since it is no longer attached.
+void Directory::Clear() {
+  std::vector<FileOrDirectory>{}.swap(entries_);
+  lookup_.reset();
+  head_ = 0;
+}
 
-  std::string input;
+std::vector<FileOrDirectory>::iterator Directory::Find(NameId name) {
+  if (!lookup_) {
+    return std::find_if(entries_.begin() + head_, entries_.end(), [name](const FileOrDirectory &file) {
+      return file.Key() == name;
+    });
+  }
 
-  while (IsRunning()) {
-    DisplayPrompt();
-    std::getline(std::cin, input);
-    
-    auto args = Tokenize(input);
-    ParseArgs(args);
+  auto found = lookup_->names.find(name);
+  if (found == lookup_->names.end()) {
+    return entries_.end();
   }
+
+  auto &sequences = lookup_->sequences;
+  return entries_.begin() + (std::lower_bound(sequences.begin() + head_, sequences.end(), found->second) - sequences.begin());
 }
 
-void Shell::Shutdown() {
-  is_running_ = false;
+void Directory::BuildLookup() {
+  lookup_ = std::make_unique<Lookup>();
+  lookup_->names.reserve(entries_.size());
+  lookup_->sequences.assign(head_, 0);
+  lookup_->sequences.reserve(entries_.size());
+  for (const auto &file : Entries()) {
+    lookup_->names[file.Key()] = lookup_->next;
+    lookup_->sequences.push_back(lookup_->next++);
+  }
 }
 
-Shell::Shell(const Computer &computer) : is_running_{true}, cwd_{"/"}, computer_{computer} {
-  auto fs = std::make_shared<FileSystem>();
-  fs->for_dev_populate();
+Usage Directory::UsageOf(const FileOrDirectory &file) {
+  Usage usage;
+  if (file.IsDirectory()) {
+    usage = file.Files()->totals_;
+    usage.directories++;
+  } else {
+    usage.files++;
+    usage.bytes += file.Size();
+  }
+  usage.entries++;
 
-  users_ = {
-    User::CreateSuperuser("root", "12345678"),
-    User::Create("user", "12345678")
-  };
+  return usage;
+}
 
-  commands_.insert({"shutdown", std::make_unique<ShutdownCommand>()});
-  commands_.insert({"ls", std::make_unique<ListCommand>(fs)});
-  commands_.insert({"mkdir", std::make_unique<MakeDirectoryCommand>(fs)});
-  commands_.insert({"clear", std::make_unique<ClearCommand>()});
-  commands_.insert({"rm", std::make_unique<RemoveCommand>(fs)});
-  commands_.insert({"chmod", std::make_unique<ChangeModeCommand>(fs)});
-  commands_.insert({"date", std::make_unique<DateCommand>()});
-  commands_.insert({"cd", std::make_unique<ChangeDirectoryCommand>(fs)});
+void Directory::Propagate(const Usage &delta, bool is_added) {
+  for (auto *directory = this; directory != nullptr; directory = directory->parent_) {
+    if (is_added) {
+      directory->totals_ += delta;
+    } else {
+      directory->totals_ -= delta;
+    }
+  }
 }
 
-bool Shell::IsRunning() const {
-  return is_running_;
+const Usage &Directory::Totals() const {
+  return totals_;
 }
 
-Argument Shell::Arg() const {
-  return arg_;
+EntryRange<std::vector<FileOrDirectory>::iterator> Directory::Entries() {
+  return {entries_.begin() + head_, entries_.end()};
 }
 
-static inline void rtrim(std::string &s) {
-  s.erase(std::find_if(s.rbegin(), s.rend(), [](unsigned char ch) {
-    return !std::isspace(ch);
-  }).base(), s.end());
+EntryRange<std::vector<FileOrDirectory>::const_iterator> Directory::Entries() const {
+  return {entries_.begin() + head_, entries_.end()};
 }
 
-std::vector<std::string> Shell::Tokenize(std::string s) {
+const PrefixIndex &Directory::Index() const {
+  return index_;
+}
+
+const Directory *Directory::Parent() const {
+  return parent_;
+}
+
+NameId Directory::Key() const {
+  return name_;
+}
+
+FileOrDirectory::FileOrDirectory(const std::string &name, bool is_directory, const std::shared_ptr<Directory> &files)
+  : name_{NameTable::Global().Intern(name)}, is_directory_{is_directory}, files_{files} {}
+
+FileOrDirectory FileOrDirectory::CreateDirectory(const std::string &name) {
+  return {name, true, std::make_shared<Directory>()};
+}
+
+FileOrDirectory FileOrDirectory::CreateFile(const std::string &name) {
+  FileOrDirectory file{name, false, nullptr};
+  file.SetPermission(READ_FLAG | WRITE_FLAG);
+
+  return file;
+}
+
+void FileOrDirectory::Add(const FileOrDirectory &file) {
+  files_->Add(file);
+}
+
+void FileOrDirectory::SetPermission(unsigned char p) {
+  permission_ = 0;
+  permission_ |= p;
+}
+
+const std::string &FileOrDirectory::Name() const {
+  return NameTable::Global().String(name_);
+}
+
+NameId FileOrDirectory::Key() const {
+  return name_;
+}
+
+unsigned char FileOrDirectory::Permission() const {
+  return permission_;
+}
+
+bool FileOrDirectory::Readable() const {
+  return (permission_ & READ_FLAG) == READ_FLAG;
+}
+
+bool FileOrDirectory::Writeable() const {
+  return (permission_ & WRITE_FLAG) == WRITE_FLAG;
+}
+
+bool FileOrDirectory::Executable() const {
+  return (permission_ & EXECUTE_FLAG) == EXECUTE_FLAG;
+}
+
+bool FileOrDirectory::IsDirectory() const {
+  return is_directory_;
+}
+
+std::shared_ptr<Directory> FileOrDirectory::Files() const {
+  return files_;
+}
+
+std::uint64_t FileOrDirectory::Size() const {
+  return data_ ? data_->size : 0;
+}
+
+std::shared_ptr<FileData> FileOrDirectory::Data() const {
+  return data_;
+}
+
+void FileOrDirectory::SetData(const std::shared_ptr<FileData> &data) {
+  data_ = data;
+}
+
+class NameIndex {
+public:
+  struct Match {
+    const Directory *parent;
+    NameId name;
+  };
+
+  void Insert(const Directory *, NameId);
+  void Erase(const Directory *, NameId);
+
+  void InsertTree(const Directory *);
+  void EraseTree(const std::vector<std::shared_ptr<Directory>> &);
+  void Clear();
+
+  void Locate(const std::string &, bool, const std::function<void(const Match &)> &) const;
+
+  bool Contains(NameId) const;
+  std::size_t Size() const;
+  std::size_t TrigramCount() const;
+  std::size_t MemoryUsage() const;
+
+private:
+  static std::uint32_t Trigram(const char *);
+  static std::uint32_t Bigram(const char *);
+  static bool GlobMatch(const std::string &, const std::string &);
+
+  void InsertName(NameId);
+  void RebuildGrams();
+
+private:
+  static constexpr std::size_t kRebuildMinimum = 4096;
+
+  // name -> directories holding entries with that name, with entry counts
+  std::unordered_map<NameId, std::unordered_map<const Directory *, std::uint32_t>> postings_;
+  // trigram and bigram -> names containing it, so substring and glob
+  // queries only scan the vocabulary, never the tree. Names whose last
+  // entry is gone stay listed (Locate skips them) until they outnumber the
+  // live ones and the lists are rebuilt from postings_.
+  std::unordered_map<std::uint32_t, std::vector<NameId>> trigrams_;
+  std::unordered_map<std::uint32_t, std::vector<NameId>> bigrams_;
+  std::vector<bool> has_trigrams_;
+  std::size_t dead_names_{0};
+
+  std::size_t size_{0};
+};
+
+std::uint32_t NameIndex::Trigram(const char *p) {
+  return static_cast<std::uint32_t>(static_cast<unsigned char>(p[0])) << 16 |
+         static_cast<std::uint32_t>(static_cast<unsigned char>(p[1])) << 8 |
+         static_cast<std::uint32_t>(static_cast<unsigned char>(p[2]));
+}
+
+std::uint32_t NameIndex::Bigram(const char *p) {
+  return static_cast<std::uint32_t>(static_cast<unsigned char>(p[0])) << 8 |
+         static_cast<std::uint32_t>(static_cast<unsigned char>(p[1]));
+}
+
+bool NameIndex::GlobMatch(const std::string &pattern, const std::string &name) {
+  std::size_t p = 0;
+  std::size_t n = 0;
+  std::size_t star = std::string::npos;
+  std::size_t resume = 0;
+
+  while (n < name.size()) {
+    if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n])) {
+      p++;
+      n++;
+    } else if (p < pattern.size() && pattern[p] == '*') {
+      star = p++;
+      resume = n;
+    } else if (star != std::string::npos) {
+      p = star + 1;
+      n = ++resume;
+    } else {
+      return false;
+    }
+  }
+
+  while (p < pattern.size() && pattern[p] == '*') {
+    p++;
+  }
+
+  return p == pattern.size();
+}
+
+void NameIndex::InsertName(NameId name) {
+  if (name >= has_trigrams_.size()) {
+    has_trigrams_.resize(std::max<std::size_t>(name + 1, has_trigrams_.size() * 2));
+  }
+
+  if (has_trigrams_[name]) {
+    return;
+  }
+  has_trigrams_[name] = true;
+
+  const auto &text = NameTable::Global().String(name);
+  std::unordered_set<std::uint32_t> seen;
+  for (std::size_t i = 0; i + 3 <= text.size(); i++) {
+    auto trigram = Trigram(text.data() + i);
+    if (seen.insert(trigram).second) {
+      trigrams_[trigram].push_back(name);
+    }
+  }
+
+  seen.clear();
+  for (std::size_t i = 0; i + 2 <= text.size(); i++) {
+    auto bigram = Bigram(text.data() + i);
+    if (seen.insert(bigram).second) {
+      bigrams_[bigram].push_back(name);
+    }
+  }
+}
+
+void NameIndex::RebuildGrams() {
+  trigrams_.clear();
+  bigrams_.clear();
+  std::fill(has_trigrams_.begin(), has_trigrams_.end(), false);
+  dead_names_ = 0;
+
+  for (const auto &[name, parents] : postings_) {
+    InsertName(name);
+  }
+}
+
+void NameIndex::Insert(const Directory *parent, NameId name) {
+  auto &parents = postings_[name];
+  if (parents.empty()) {
+    if (name < has_trigrams_.size() && has_trigrams_[name]) {
+      dead_names_--;
+    }
+    InsertName(name);
+  }
+
+  parents[parent]++;
+  size_++;
+}
+
+void NameIndex::Erase(const Directory *parent, NameId name) {
+  auto it = postings_.find(name);
+  if (it == postings_.end()) {
+    return;
+  }
+
+  auto &parents = it->second;
+  auto position = parents.find(parent);
+  if (position == parents.end()) {
+    return;
+  }
+
+  if (--position->second == 0) {
+    parents.erase(position);
+  }
+  size_--;
+
+  if (parents.empty()) {
+    postings_.erase(it);
+    dead_names_++;
+
+    if (dead_names_ > kRebuildMinimum && dead_names_ > postings_.size()) {
+      RebuildGrams();
+    }
+  }
+}
+
+void NameIndex::InsertTree(const Directory *root) {
+  std::vector<const Directory *> pending{root};
+  while (!pending.empty()) {
+    const auto *directory = pending.back();
+    pending.pop_back();
+
+    for (const auto &entry : directory->Entries()) {
+      Insert(directory, entry.Key());
+      if (entry.IsDirectory()) {
+        pending.push_back(entry.Files().get());
+      }
+    }
+  }
+}
+
+void NameIndex::EraseTree(const std::vector<std::shared_ptr<Directory>> &directories) {
+  for (const auto &directory : directories) {
+    for (const auto &entry : directory->Entries()) {
+      Erase(directory.get(), entry.Key());
+    }
+  }
+}
+
+void NameIndex::Clear() {
+  postings_.clear();
+  trigrams_.clear();
+  bigrams_.clear();
+  has_trigrams_.clear();
+  dead_names_ = 0;
+  size_ = 0;
+}
+
+void NameIndex::Locate(const std::string &pattern, bool is_exact, const std::function<void(const Match &)> &func) const {
+  const auto &table = NameTable::Global();
+
+  auto collect = [&](NameId name) {
+    auto it = postings_.find(name);
+    if (it == postings_.end()) {
+      return;
+    }
+    for (const auto &[parent, count] : it->second) {
+      for (std::uint32_t i = 0; i < count; i++) {
+        func({parent, name});
+      }
+    }
+  };
+
+  if (is_exact) {
+    auto name = table.Find(pattern);
+    if (name != NameTable::kMissing) {
+      collect(name);
+    }
+    return;
+  }
+
+  bool is_glob = pattern.find_first_of("*?") != std::string::npos;
+
+  // Every literal run of two or more bytes narrows the candidates to the
+  // shortest list among its trigrams, or its bigram when it is two bytes
+  // long. Only a pattern without such a run (one byte, or wildcards only)
+  // falls back to checking every live name. That is intended: such a
+  // pattern matches a large share of all names, so the result is about as
+  // long as the scan, and byte lists would cost an entry per distinct
+  // byte of every name.
+  const std::vector<NameId> *candidates = nullptr;
+  auto narrow = [&](const std::unordered_map<std::uint32_t, std::vector<NameId>> &grams, std::uint32_t gram) {
+    auto it = grams.find(gram);
+    if (it == grams.end()) {
+      return false;
+    }
+
+    if (candidates == nullptr || it->second.size() < candidates->size()) {
+      candidates = &it->second;
+    }
+    return true;
+  };
+
+  std::size_t begin = 0;
+  while (begin < pattern.size()) {
+    auto end = is_glob ? pattern.find_first_of("*?", begin) : std::string::npos;
+    if (end == std::string::npos) {
+      end = pattern.size();
+    }
+
+    if (end - begin == 2 && !narrow(bigrams_, Bigram(pattern.data() + begin))) {
+      return;
+    }
+    for (auto i = begin; i + 3 <= end; i++) {
+      if (!narrow(trigrams_, Trigram(pattern.data() + i))) {
+        return;
+      }
+    }
+
+    begin = end + 1;
+  }
+
+  auto is_match = [&](NameId name) {
+    const auto &text = table.String(name);
+    return is_glob ? GlobMatch(pattern, text) : text.find(pattern) != std::string::npos;
+  };
+
+  if (candidates != nullptr) {
+    for (auto name : *candidates) {
+      if (is_match(name)) {
+        collect(name);
+      }
+    }
+    return;
+  }
+
+  for (const auto &[name, parents] : postings_) {
+    if (is_match(name)) {
+      collect(name);
+    }
+  }
+}
+
+bool NameIndex::Contains(NameId name) const {
+  return postings_.find(name) != postings_.end();
+}
+
+std::size_t NameIndex::Size() const {
+  return size_;
+}
+
+std::size_t NameIndex::TrigramCount() const {
+  return trigrams_.size();
+}
+
+std::size_t NameIndex::MemoryUsage() const {
+  constexpr std::size_t kNodeOverhead = 2 * sizeof(void *);
+
+  std::size_t bytes = (postings_.bucket_count() + trigrams_.bucket_count() + bigrams_.bucket_count()) * sizeof(void *) +
+                      has_trigrams_.capacity() / 8;
+  for (const auto &[name, parents] : postings_) {
+    bytes += kNodeOverhead + sizeof(name) + sizeof(parents) + parents.bucket_count() * sizeof(void *) +
+             parents.size() * (kNodeOverhead + sizeof(const Directory *) + sizeof(std::uint32_t));
+  }
+  for (const auto *grams : {&trigrams_, &bigrams_}) {
+    for (const auto &[gram, names] : *grams) {
+      bytes += kNodeOverhead + sizeof(gram) + sizeof(names) + names.capacity() * sizeof(NameId);
+    }
+  }
+
+  return bytes;
+}
+
+static void PutVarint(std::string &out, std::uint64_t value) {
+  while (value >= 0x80) {
+    out.push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<char>(value));
+}
+
+static bool GetVarint(const char *&in, const char *end, std::uint64_t &value) {
+  value = 0;
+  for (int shift = 0; shift < 64 && in < end; shift += 7) {
+    auto byte = static_cast<unsigned char>(*in++);
+    value |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void PutString(std::string &out, const std::string &value) {
+  PutVarint(out, value.size());
+  out += value;
+}
+
+static bool GetString(const char *&in, const char *end, std::string &value) {
+  std::uint64_t size;
+  if (!GetVarint(in, end, size) || size > static_cast<std::uint64_t>(end - in)) {
+    return false;
+  }
+  value.assign(in, size);
+  in += size;
+  return true;
+}
+
+static void PutFixed(std::string &out, std::uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    out.push_back(static_cast<char>(value >> (8 * i)));
+  }
+}
+
+static bool GetFixed(const char *&in, const char *end, std::uint64_t &value, int bytes) {
+  if (end - in < bytes) {
+    return false;
+  }
+  value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value |= static_cast<std::uint64_t>(static_cast<unsigned char>(*in++)) << (8 * i);
+  }
+  return true;
+}
+
+static std::uint32_t Checksum(const char *data, std::size_t size) {
+  std::uint32_t hash = 2166136261u;
+  for (std::size_t i = 0; i < size; i++) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static bool SyncFile(std::FILE *file) {
+  if (std::fflush(file) != 0) {
+    return false;
+  }
+#if defined(_WIN32)
+  return _commit(_fileno(file)) == 0;
+#elif defined(__linux__)
+  return fdatasync(fileno(file)) == 0;
+#else
+  return fsync(fileno(file)) == 0;
+#endif
+}
+
+static void SyncDirectory(const std::string &path) {
+#if !defined(_WIN32)
+  auto parent = std::filesystem::path{path}.parent_path();
+  int fd = open(parent.empty() ? "." : parent.c_str(), O_RDONLY);
+  if (fd != -1) {
+    fsync(fd);
+    close(fd);
+  }
+#endif
+}
+
+static bool ReadWholeFile(const std::string &path, std::string &content) {
+  std::ifstream file{path, std::ios::binary};
+  if (!file) {
+    return false;
+  }
+
+  content.assign(std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{});
+  return true;
+}
+
+class Journal {
+public:
+  enum class Operation : unsigned char {
+    kMakeDirectory = 1,
+    kRemove = 2,
+    kChangeMode = 3,
+    kMakeDirectories = 4,
+    kRemoveTree = 5,
+    kChangeModeTree = 6,
+    kCreateFile = 7,
+    kWriteFile = 8,
+    kAppendFile = 9,
+    kTruncate = 10,
+  };
+
+  struct Record {
+    Operation operation;
+    std::vector<std::string> parent;
+    std::string name;
+    unsigned char mode{0};
+    std::string data;
+    std::uint64_t size{0};
+  };
+
+  explicit Journal(const std::string &);
+  ~Journal();
+
+  std::uint64_t Open(std::vector<Record> &);
+
+  void Append(const Record &);
+  bool Commit();
+  void Reset(std::uint64_t);
+
+  std::size_t RecordsSinceReset() const;
+  bool IsFailed() const;
+
+private:
+  void FlushLoop();
+  void Drain();
+
+private:
+  static constexpr char kMagic[4] = {'P', 'J', 'N', 'L'};
+  static constexpr std::size_t kHeaderSize = 12;
+  static constexpr std::chrono::milliseconds kCommitInterval{10};
+  static constexpr std::size_t kCommitBytes = 1 << 20;
+
+  std::string path_;
+  std::FILE *file_{nullptr};
+
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  std::string pending_;
+  std::size_t records_since_reset_{0};
+  bool is_stopping_{false};
+  bool is_failed_{false};
+
+  std::mutex io_mutex_;
+  std::thread flusher_;
+};
+
+Journal::Journal(const std::string &path) : path_{path} {}
+
+Journal::~Journal() {
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    is_stopping_ = true;
+  }
+  cv_.notify_one();
+
+  if (flusher_.joinable()) {
+    flusher_.join();
+  }
+
+  Drain();
+
+  if (file_ != nullptr) {
+    std::fclose(file_);
+  }
+}
+
+std::uint64_t Journal::Open(std::vector<Record> &records) {
+  std::string content;
+  ReadWholeFile(path_, content);
+
+  const char *in = content.data();
+  const char *end = in + content.size();
+
+  std::uint64_t generation = 0;
+  if (content.size() < kHeaderSize || content.compare(0, 4, kMagic, 4) != 0) {
+    content.clear();
+    in = end = content.data();
+  } else {
+    in += 4;
+    GetFixed(in, end, generation, 8);
+  }
+
+  const char *valid_end = in;
+  while (in < end) {
+    std::uint64_t size;
+    std::uint64_t checksum;
+    if (!GetVarint(in, end, size) || size > static_cast<std::uint64_t>(end - in)) {
+      break;
+    }
+
+    const char *payload = in;
+    const char *payload_end = in + size;
+    in = payload_end;
+    if (!GetFixed(in, end, checksum, 4) || checksum != Checksum(payload, size)) {
+      break;
+    }
+
+    Record record;
+    const char *p = payload;
+    std::uint64_t count;
+    if (p == payload_end) {
+      break;
+    }
+    record.operation = static_cast<Operation>(*p++);
+    if (!GetVarint(p, payload_end, count)) {
+      break;
+    }
+
+    bool is_valid = true;
+    record.parent.resize(count);
+    for (auto &component : record.parent) {
+      is_valid = is_valid && GetString(p, payload_end, component);
+    }
+    is_valid = is_valid && GetString(p, payload_end, record.name);
+    if (is_valid && (record.operation == Operation::kChangeMode || record.operation == Operation::kChangeModeTree)) {
+      is_valid = p < payload_end;
+      record.mode = is_valid ? static_cast<unsigned char>(*p++) : 0;
+    }
+    if (is_valid && (record.operation == Operation::kWriteFile || record.operation == Operation::kAppendFile)) {
+      is_valid = GetString(p, payload_end, record.data);
+    }
+    if (is_valid && record.operation == Operation::kTruncate) {
+      is_valid = GetVarint(p, payload_end, record.size);
+    }
+
+    if (!is_valid) {
+      break;
+    }
+
+    records.push_back(std::move(record));
+    valid_end = in;
+  }
+
+  if (content.empty()) {
+    file_ = std::fopen(path_.c_str(), "wb");
+  } else {
+    // A torn tail from a crash mid-commit is cut off so new records are
+    // appended right after the last intact one.
+    std::error_code error;
+    std::filesystem::resize_file(path_, valid_end - content.data(), error);
+    file_ = std::fopen(path_.c_str(), "ab");
+  }
+
+  records_since_reset_ = records.size();
+  flusher_ = std::thread{&Journal::FlushLoop, this};
+
+  return generation;
+}
+
+void Journal::Append(const Record &record) {
+  std::string payload;
+  payload.push_back(static_cast<char>(record.operation));
+  PutVarint(payload, record.parent.size());
+  for (const auto &component : record.parent) {
+    PutString(payload, component);
+  }
+  PutString(payload, record.name);
+  if (record.operation == Operation::kChangeMode || record.operation == Operation::kChangeModeTree) {
+    payload.push_back(static_cast<char>(record.mode));
+  }
+  if (record.operation == Operation::kWriteFile || record.operation == Operation::kAppendFile) {
+    PutString(payload, record.data);
+  }
+  if (record.operation == Operation::kTruncate) {
+    PutVarint(payload, record.size);
+  }
+
+  bool is_full = false;
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    PutVarint(pending_, payload.size());
+    pending_ += payload;
+    PutFixed(pending_, Checksum(payload.data(), payload.size()), 4);
+    records_since_reset_++;
+    is_full = pending_.size() >= kCommitBytes;
+  }
+
+  if (is_full) {
+    cv_.notify_one();
+  }
+}
+
+bool Journal::Commit() {
+  Drain();
+  return !IsFailed();
+}
+
+void Journal::Drain() {
+  std::lock_guard<std::mutex> io_lock{io_mutex_};
+
+  std::string batch;
+  bool is_failed;
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    batch.swap(pending_);
+    is_failed = is_failed_;
+  }
+
+  // A failed write may leave a partial record, and replay stops there, so
+  // nothing more is appended until a checkpoint resets the journal.
+  if (batch.empty() || is_failed) {
+    return;
+  }
+
+  if (file_ == nullptr || std::fwrite(batch.data(), 1, batch.size(), file_) != batch.size() || !SyncFile(file_)) {
+    std::lock_guard<std::mutex> lock{mutex_};
+    is_failed_ = true;
+  }
+}
+
+void Journal::FlushLoop() {
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock{mutex_};
+      cv_.wait_for(lock, kCommitInterval, [this] {
+        return is_stopping_ || pending_.size() >= kCommitBytes;
+      });
+
+      if (is_stopping_) {
+        return;
+      }
+
+      if (pending_.empty()) {
+        continue;
+      }
+    }
+
+    Drain();
+  }
+}
+
+void Journal::Reset(std::uint64_t generation) {
+  std::lock_guard<std::mutex> io_lock{io_mutex_};
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    pending_.clear();
+    records_since_reset_ = 0;
+  }
+
+  if (file_ != nullptr) {
+    std::fclose(file_);
+  }
+
+  std::string header{kMagic, 4};
+  PutFixed(header, generation, 8);
+
+  file_ = std::fopen(path_.c_str(), "wb");
+  bool is_written = file_ != nullptr && std::fwrite(header.data(), 1, header.size(), file_) == header.size() &&
+                    SyncFile(file_);
+
+  std::lock_guard<std::mutex> lock{mutex_};
+  is_failed_ = !is_written;
+}
+
+std::size_t Journal::RecordsSinceReset() const {
+  std::lock_guard<std::mutex> lock{mutex_};
+  return records_since_reset_;
+}
+
+bool Journal::IsFailed() const {
+  std::lock_guard<std::mutex> lock{mutex_};
+  return is_failed_;
+}
+
+class FileSystem {
+public:
+  FileSystem(std::uint64_t, std::uint64_t);
+  ~FileSystem();
+
+  void for_dev_populate();
+
+  bool Open(const std::string &, const std::string &);
+  void Checkpoint();
+
+  std::string Snapshot();
+  bool Restore(const std::string &);
+
+  void Add(const FileOrDirectory &);
+
+  enum class Status {
+    kOk,
+    kNotFound,
+    kExists,
+    kIsDirectory,
+    kNotDirectory,
+    kNoSpace,
+    kReadOnly,
+    kBusy,
+    kUnsupported,
+    kIoError,
+  };
+
+  Status MakeDirectory(const std::vector<std::string> &, bool);
+  Status Remove(const std::vector<std::string> &, bool);
+  Status ChangeMode(const std::vector<std::string> &, unsigned char, bool);
+
+  Status CreateFile(const std::vector<std::string> &);
+  Status WriteFile(const std::vector<std::string> &, const std::string &, bool);
+  Status Truncate(const std::vector<std::string> &, std::uint64_t);
+  Status ReadFile(const std::vector<std::string> &, const std::function<void(const char *, std::size_t)> &);
+
+  Status Sync();
+
+  Status Mount(const std::string &, const std::vector<std::string> &);
+  Status Unmount(const std::vector<std::string> &);
+  std::vector<std::pair<std::string, std::string>> Mounts() const;
+
+  const BlockDevice &Device() const;
+  const PageCache &Cache() const;
+
+  std::shared_ptr<Directory> Resolve(const std::vector<std::string> &);
+  void TraverseDirectory(const std::vector<std::string> &, const std::function<void(std::shared_ptr<Directory>)> &func);
+
+  std::shared_ptr<Directory> Root() {
+    return root_;
+  }
+
+  void SetRoot(const std::shared_ptr<Directory> &);
+
+  void Locate(const std::string &, bool, const std::function<void(const std::string &)> &) const;
+  const NameIndex &Index() const;
+
+  std::string PathOf(const Directory *) const;
+  std::vector<std::string> Check() const;
+
+private:
+  Status Apply(const Journal::Record &, const std::shared_ptr<Directory> &);
+  Status Mutate(const Journal::Record &);
+
+  void Detach(Directory &, std::vector<FileOrDirectory>::iterator);
+  void Teardown(std::shared_ptr<Directory>);
+
+  bool IsHost(const Directory *) const;
+  Status CheckHost(const Journal::Record &, const std::shared_ptr<Directory> &);
+  void Materialize(const std::shared_ptr<Directory> &);
+  void PollHost();
+  void Forget(const Directory *);
+
+  bool Reserve(FileData &, std::uint64_t);
+  Status Resize(FileOrDirectory &, Directory &, std::uint64_t);
+  void Release(FileData &);
+  void Release(const BlockDevice::Extent &);
+  void WriteBytes(const FileData &, std::uint64_t, const char *, std::size_t);
+
+  std::string EncodeImage(std::uint64_t);
+  bool DecodeImage(const std::string &, std::uint64_t &);
+  bool SaveImage(std::uint64_t);
+  bool LoadImage(std::uint64_t &);
+
+private:
+  // Checkpoints run inline on the mutation that crosses the interval: the
+  // whole tree and every written block are encoded, synced and renamed
+  // before that command returns, which takes seconds on a large tree. The
+  // interval keeps that rare, and replay after a crash short.
+  static constexpr std::size_t kCheckpointInterval = 1 << 16;
+  static constexpr std::size_t kReadAheadMin = 4;
+  static constexpr std::size_t kReadAheadMax = 32;
+
+  std::shared_ptr<Directory> root_;
+  NameIndex index_;
+  BlockDevice device_;
+  PageCache cache_;
+
+  std::unique_ptr<Journal> journal_;
+  std::string image_path_;
+  std::uint64_t generation_{0};
+  std::size_t checkpoint_due_{kCheckpointInterval};
+
+  // Directories backed by a host directory, listed the first time they
+  // are resolved and again whenever inotify reports a change to them.
+  struct HostDirectory {
+    std::string path;
+    int watch{-1};
+    bool is_loaded{false};
+    bool is_stale{false};
+  };
+
+  std::unordered_map<const Directory *, HostDirectory> hosts_;
+  std::unordered_map<int, std::vector<const Directory *>> watches_;
+  std::vector<const Directory *> mounts_;
+  int inotify_fd_{-1};
+};
+
+FileSystem::FileSystem(std::uint64_t capacity, std::uint64_t memory)
+  : device_{capacity}, cache_{device_, static_cast<std::size_t>(memory / BlockDevice::kBlockSize)} {}
+
+FileSystem::~FileSystem() {
+#if defined(__linux__)
+  if (inotify_fd_ >= 0) {
+    close(inotify_fd_);
+  }
+#endif
+}
+
+void FileSystem::for_dev_populate() {
+  auto tmp = FileOrDirectory::CreateDirectory("tmp");
+  tmp.Add(FileOrDirectory::CreateFile("file.txt"));
+  tmp.Add(FileOrDirectory::CreateFile("file2.txt"));
+
+  auto sys = FileOrDirectory::CreateDirectory("sys");
+
+  auto usr = FileOrDirectory::CreateDirectory("usr");
+  usr.Add(FileOrDirectory::CreateDirectory("bin"));
+
+  auto root = std::make_shared<Directory>();
+  root->Add(tmp);
+  root->Add(sys);
+  root->Add(usr);
+  root->Add(FileOrDirectory::CreateFile("log.txt"));
+
+  SetRoot(root);
+}
+
+void FileSystem::Add(const FileOrDirectory &file) {
+  root_->Add(file);
+
+  index_.Insert(root_.get(), file.Key());
+  if (file.IsDirectory()) {
+    index_.InsertTree(file.Files().get());
+  }
+}
+
+void FileSystem::SetRoot(const std::shared_ptr<Directory> &root) {
+  root_ = root;
+
+  index_.Clear();
+  index_.InsertTree(root_.get());
+}
+
+// Hands each match to func as it is found, so a large result is never
+// held in full.
+void FileSystem::Locate(const std::string &pattern, bool is_exact, const std::function<void(const std::string &)> &func) const {
+  index_.Locate(pattern, is_exact, [&](const NameIndex::Match &match) {
+    func(PathOf(match.parent) + '/' + NameTable::Global().String(match.name));
+  });
+}
+
+std::string FileSystem::PathOf(const Directory *directory) const {
+  std::vector<NameId> components;
+  for (; directory->Parent() != nullptr; directory = directory->Parent()) {
+    components.push_back(directory->Key());
+  }
+
+  std::string path;
+  for (auto it = components.rbegin(); it != components.rend(); it++) {
+    path += '/';
+    path += NameTable::Global().String(*it);
+  }
+
+  return path;
+}
+
+std::vector<std::string> FileSystem::Check() const {
+  std::vector<std::string> problems;
+
+  std::vector<BlockDevice::Extent> allocated;
+  std::vector<const Directory *> directories{root_.get()};
+  for (std::size_t i = 0; i < directories.size(); i++) {
+    for (const auto &entry : directories[i]->Entries()) {
+      if (entry.IsDirectory()) {
+        directories.push_back(entry.Files().get());
+      } else if (auto data = entry.Data()) {
+        allocated.insert(allocated.end(), data->extents.begin(), data->extents.end());
+      }
+    }
+  }
+
+  // Children come after their parents in the walk above, so going through
+  // it backwards rebuilds every subtree total from scratch bottom-up.
+  std::unordered_map<const Directory *, Usage> actual;
+  std::unordered_set<NameId> names;
+  for (auto it = directories.rbegin(); it != directories.rend(); it++) {
+    Usage usage;
+    names.clear();
+    for (const auto &entry : (*it)->Entries()) {
+      if (!names.insert(entry.Key()).second) {
+        problems.push_back(PathOf(*it) + '/' + entry.Name() + ": duplicate name");
+      }
+
+      if (entry.IsDirectory()) {
+        usage += actual[entry.Files().get()];
+        usage.directories++;
+      } else {
+        usage.files++;
+        usage.bytes += entry.Size();
+      }
+      usage.entries++;
+    }
+
+    if (!(usage == (*it)->Totals())) {
+      const auto &recorded = (*it)->Totals();
+      auto path = PathOf(*it);
+      problems.push_back((path.empty() ? "/" : path) + ": recorded " + std::to_string(recorded.entries) +
+                         " entries, " + std::to_string(recorded.bytes) + " bytes, found " +
+                         std::to_string(usage.entries) + " entries, " + std::to_string(usage.bytes) + " bytes");
+    }
+
+    actual[*it] = usage;
+  }
+
+  if (actual[root_.get()].entries != index_.Size()) {
+    problems.push_back("name index holds " + std::to_string(index_.Size()) + " entries, tree has " +
+                       std::to_string(actual[root_.get()].entries));
+  }
+
+  for (auto &problem : device_.Check(std::move(allocated))) {
+    problems.push_back("block device: " + problem);
+  }
+
+  return problems;
+}
+
+const NameIndex &FileSystem::Index() const {
+  return index_;
+}
+
+bool FileSystem::Open(const std::string &image_path, const std::string &journal_path) {
+  image_path_ = image_path;
+
+  std::error_code error;
+  bool has_image = std::filesystem::exists(image_path_, error);
+
+  // An image that exists but does not load is left untouched, and so is
+  // its journal, which only replays on top of it. The session runs without
+  // a journal rather than checkpoint a fresh tree over the user's data.
+  std::uint64_t image_generation = 0;
+  if (has_image && !LoadImage(image_generation)) {
+    for_dev_populate();
+    return false;
+  }
+
+  journal_ = std::make_unique<Journal>(journal_path);
+  std::vector<Journal::Record> records;
+  auto journal_generation = journal_->Open(records);
+
+  if (!has_image) {
+    for_dev_populate();
+    generation_ = 0;
+    Checkpoint();
+    return true;
+  }
+
+  generation_ = image_generation;
+
+  // A journal from another generation was already folded into the image
+  // by a checkpoint that crashed before it could truncate the journal.
+  if (journal_generation != image_generation) {
+    journal_->Reset(generation_);
+    return true;
+  }
+
+  std::vector<std::string> cached_cwd;
+  std::shared_ptr<Directory> cached_directory;
+  for (const auto &record : records) {
+    if (record.operation == Journal::Operation::kMakeDirectories) {
+      Apply(record, root_);
+      continue;
+    }
+
+    std::vector<std::string> cwd{"/"};
+    cwd.insert(cwd.end(), record.parent.begin(), record.parent.end());
+
+    if (!cached_directory || cwd != cached_cwd) {
+      cached_cwd = cwd;
+      cached_directory = Resolve(cwd);
+    }
+
+    if (cached_directory) {
+      Apply(record, cached_directory);
+    }
+
+    if (record.operation == Journal::Operation::kRemoveTree) {
+      cached_directory.reset();
+    }
+  }
+
+  return true;
+}
+
+void FileSystem::Checkpoint() {
+  if (!journal_) {
+    return;
+  }
+
+  if (generation_ != 0 && journal_->RecordsSinceReset() == 0 && !journal_->IsFailed()) {
+    return;
+  }
+
+  // A failed save is not retried by every following mutation; the journal
+  // keeps growing until another interval has passed.
+  if (!SaveImage(generation_ + 1)) {
+    checkpoint_due_ = journal_->RecordsSinceReset() + kCheckpointInterval;
+    return;
+  }
+
+  generation_++;
+  journal_->Reset(generation_);
+  checkpoint_due_ = kCheckpointInterval;
+}
+
+std::string FileSystem::Snapshot() {
+  return EncodeImage(generation_);
+}
+
+bool FileSystem::Restore(const std::string &image) {
+  std::uint64_t generation;
+  return DecodeImage(image, generation);
+}
+
+std::string FileSystem::EncodeImage(std::uint64_t generation) {
+  cache_.Flush();
+
+  std::string image{"PIM2"};
+  PutFixed(image, generation, 8);
+
+  std::vector<char> buffer(BlockDevice::kBlockSize);
+
+  std::function<void(const Directory &)> write_directory = [&](const Directory &directory) {
+    // Host mounts last only as long as the process; their mount points are
+    // saved empty.
+    if (IsHost(&directory)) {
+      PutVarint(image, 0);
+      return;
+    }
+
+    const auto &entries = directory.Entries();
+    PutVarint(image, entries.size());
+    for (const auto &entry : entries) {
+      image.push_back(entry.IsDirectory() ? 1 : 0);
+      image.push_back(static_cast<char>(entry.Permission()));
+      PutString(image, entry.Name());
+      if (entry.IsDirectory()) {
+        write_directory(*entry.Files());
+        continue;
+      }
+
+      // Files keep their size and only the blocks that were ever written,
+      // each tagged with its index within the file.
+      auto data = entry.Data();
+      PutVarint(image, data ? data->size : 0);
+
+      std::vector<std::pair<std::uint64_t, std::uint64_t>> written;
+      std::uint64_t base = 0;
+      for (const auto &extent : data ? data->extents : std::vector<BlockDevice::Extent>{}) {
+        device_.ForEachWritten(extent, [&](std::uint64_t block) {
+          written.emplace_back(base + (block - extent.start), block);
+        });
+        base += std::uint64_t{1} << extent.order;
+      }
+
+      PutVarint(image, written.size());
+      for (const auto &[index, block] : written) {
+        PutVarint(image, index);
+        device_.Read(block, buffer.data());
+        image.append(buffer.data(), buffer.size());
+      }
+    }
+  };
+  write_directory(*root_);
+
+  return image;
+}
+
+bool FileSystem::SaveImage(std::uint64_t generation) {
+  auto image = EncodeImage(generation);
+
+  auto temporary_path = image_path_ + ".tmp";
+  auto *file = std::fopen(temporary_path.c_str(), "wb");
+  if (file == nullptr) {
+    return false;
+  }
+
+  bool is_written = std::fwrite(image.data(), 1, image.size(), file) == image.size() && SyncFile(file);
+  is_written = std::fclose(file) == 0 && is_written;
+
+  if (!is_written) {
+    return false;
+  }
+
+  std::error_code error;
+  std::filesystem::rename(temporary_path, image_path_, error);
+  if (error) {
+    return false;
+  }
+
+  SyncDirectory(image_path_);
+  return true;
+}
+
+bool FileSystem::LoadImage(std::uint64_t &generation) {
+  std::string content;
+  return ReadWholeFile(image_path_, content) && DecodeImage(content, generation);
+}
+
+bool FileSystem::DecodeImage(const std::string &content, std::uint64_t &generation) {
+  if (content.compare(0, 4, "PIM2") != 0) {
+    return false;
+  }
+
+  const char *in = content.data() + 4;
+  const char *end = content.data() + content.size();
+  if (!GetFixed(in, end, generation, 8)) {
+    return false;
+  }
+
+  std::function<bool(Directory &)> read_directory = [&](Directory &directory) {
+    std::uint64_t count;
+    if (!GetVarint(in, end, count)) {
+      return false;
+    }
+
+    for (std::uint64_t i = 0; i < count; i++) {
+      if (end - in < 2) {
+        return false;
+      }
+
+      bool is_directory = *in++ != 0;
+      auto permission = static_cast<unsigned char>(*in++);
+
+      std::string name;
+      if (!GetString(in, end, name)) {
+        return false;
+      }
+
+      auto entry = is_directory ? FileOrDirectory::CreateDirectory(name) : FileOrDirectory::CreateFile(name);
+      entry.SetPermission(permission);
+      if (is_directory && !read_directory(*entry.Files())) {
+        return false;
+      }
+
+      if (!is_directory) {
+        auto data = std::make_shared<FileData>();
+        std::uint64_t size, written;
+        if (!GetVarint(in, end, size) || !Reserve(*data, size) || !GetVarint(in, end, written)) {
+          return false;
+        }
+
+        for (std::uint64_t j = 0; j < written; j++) {
+          std::uint64_t index;
+          if (!GetVarint(in, end, index) || index >= data->Blocks() ||
+              static_cast<std::size_t>(end - in) < BlockDevice::kBlockSize) {
+            return false;
+          }
+
+          WriteBytes(*data, index * BlockDevice::kBlockSize, in, BlockDevice::kBlockSize);
+          in += BlockDevice::kBlockSize;
+        }
+        entry.SetData(data);
+      }
+
+      directory.Add(entry);
+    }
+
+    return true;
+  };
+
+  auto root = std::make_shared<Directory>();
+  if (!read_directory(*root)) {
+    cache_.Clear();
+    device_ = BlockDevice{device_.BlockCount() * BlockDevice::kBlockSize};
+    return false;
+  }
+
+  SetRoot(root);
+  return true;
+}
+
+FileSystem::Status FileSystem::Apply(const Journal::Record &record, const std::shared_ptr<Directory> &files) {
+  auto entries = files->Entries();
+  auto key = NameTable::Global().Find(record.name);
+
+  switch (record.operation) {
+    case Journal::Operation::kMakeDirectory:
+      if (files->Find(key) != entries.end()) {
+        return Status::kExists;
+      }
+      {
+        auto directory = FileOrDirectory::CreateDirectory(record.name);
+        files->Add(directory);
+        index_.Insert(files.get(), directory.Key());
+      }
+      return Status::kOk;
+    case Journal::Operation::kMakeDirectories: {
+      // files is the root here: every component is looked up once on the
+      // way down and whatever is missing from that point on is appended.
+      auto current = files;
+      bool is_created = false;
+      for (std::size_t i = 0; i <= record.parent.size(); i++) {
+        const auto &component = i < record.parent.size() ? record.parent[i] : record.name;
+
+        std::shared_ptr<Directory> next;
+        auto component_key = is_created ? NameTable::kMissing : NameTable::Global().Find(component);
+        if (component_key != NameTable::kMissing) {
+          auto it = current->Find(component_key);
+          if (it != current->Entries().end()) {
+            if (!it->IsDirectory()) {
+              return Status::kNotDirectory;
+            }
+            next = it->Files();
+          }
+        }
+
+        if (!next) {
+          auto directory = FileOrDirectory::CreateDirectory(component);
+          next = directory.Files();
+          current->Add(directory);
+          index_.Insert(current.get(), directory.Key());
+          is_created = true;
+        }
+        current = next;
+      }
+      return is_created ? Status::kOk : Status::kExists;
+    }
+    case Journal::Operation::kRemove:
+    case Journal::Operation::kRemoveTree: {
+      auto it = files->Find(key);
+      if (it == entries.end() || (it->IsDirectory() && record.operation == Journal::Operation::kRemove)) {
+        return Status::kNotFound;
+      }
+
+      Detach(*files, it);
+      return Status::kOk;
+    }
+    case Journal::Operation::kChangeMode:
+    case Journal::Operation::kChangeModeTree: {
+      auto it = files->Find(key);
+      if (it == entries.end()) {
+        return Status::kNotFound;
+      }
+
+      it->SetPermission(record.mode);
+      if (it->IsDirectory() && record.operation == Journal::Operation::kChangeModeTree &&
+          !IsHost(it->Files().get())) {
+        std::vector<std::shared_ptr<Directory>> pending{it->Files()};
+        while (!pending.empty()) {
+          auto current = std::move(pending.back());
+          pending.pop_back();
+
+          for (auto &entry : current->Entries()) {
+            entry.SetPermission(record.mode);
+            if (entry.IsDirectory() && !IsHost(entry.Files().get())) {
+              pending.push_back(entry.Files());
+            }
+          }
+        }
+      }
+      return Status::kOk;
+    }
+    case Journal::Operation::kCreateFile:
+    case Journal::Operation::kWriteFile:
+    case Journal::Operation::kAppendFile:
+    case Journal::Operation::kTruncate: {
+      auto it = files->Find(key);
+      if (it != entries.end() && it->IsDirectory()) {
+        return Status::kIsDirectory;
+      }
+      if (it != entries.end() && record.operation == Journal::Operation::kCreateFile) {
+        return Status::kExists;
+      }
+
+      bool is_created = it == entries.end();
+      if (is_created) {
+        auto file = FileOrDirectory::CreateFile(record.name);
+        files->Add(file);
+        index_.Insert(files.get(), file.Key());
+        it = files->Entries().end() - 1;
+      }
+
+      if (record.operation == Journal::Operation::kCreateFile) {
+        return Status::kOk;
+      }
+
+      std::uint64_t offset = record.operation == Journal::Operation::kAppendFile ? it->Size() : 0;
+      auto size = record.operation == Journal::Operation::kTruncate ? record.size : offset + record.data.size();
+      if (Resize(*it, *files, size) != Status::kOk) {
+        if (is_created) {
+          auto created_key = it->Key();
+          files->Erase(it);
+          index_.Erase(files.get(), created_key);
+        }
+        return Status::kNoSpace;
+      }
+
+      if (!record.data.empty()) {
+        WriteBytes(*it->Data(), offset, record.data.data(), record.data.size());
+      }
+      return Status::kOk;
+    }
+  }
+
+  return Status::kNotFound;
+}
+
+bool FileSystem::Reserve(FileData &data, std::uint64_t size) {
+  auto needed = (size + BlockDevice::kBlockSize - 1) / BlockDevice::kBlockSize;
+  auto have = data.Blocks();
+
+  if (needed > have && !device_.Allocate(needed - have, data.extents)) {
+    return false;
+  }
+
+  if (needed < have) {
+    // Whole extents past the new end go back as they are; the one that
+    // straddles it is halved until the kept part is made of whole extents.
+    std::vector<BlockDevice::Extent> kept;
+    auto remaining = needed;
+    for (const auto &extent : data.extents) {
+      auto start = extent.start;
+      auto order = extent.order;
+      while (remaining > 0 && remaining < (std::uint64_t{1} << order)) {
+        order--;
+        auto half = std::uint64_t{1} << order;
+        if (remaining >= half) {
+          kept.push_back({start, order});
+          remaining -= half;
+          start += half;
+        } else {
+          Release({start + half, order});
+        }
+      }
+
+      if (remaining == 0) {
+        Release({start, order});
+      } else {
+        kept.push_back({start, order});
+        remaining -= std::uint64_t{1} << order;
+      }
+    }
+    data.extents = std::move(kept);
+  }
+
+  // Bytes past the end of the last block must read back as zeroes if the
+  // file grows again.
+  if (size < data.size && size % BlockDevice::kBlockSize != 0) {
+    std::string zeroes(BlockDevice::kBlockSize - size % BlockDevice::kBlockSize, '\0');
+    WriteBytes(data, size, zeroes.data(), zeroes.size());
+  }
+
+  data.size = size;
+  return true;
+}
+
+FileSystem::Status FileSystem::Resize(FileOrDirectory &file, Directory &parent, std::uint64_t size) {
+  auto data = file.Data();
+  if (!data) {
+    data = std::make_shared<FileData>();
+  }
+
+  auto old_size = data->size;
+  if (!Reserve(*data, size)) {
+    return Status::kNoSpace;
+  }
+  file.SetData(data);
+
+  if (size > old_size) {
+    parent.Propagate({0, 0, 0, size - old_size}, true);
+  } else if (size < old_size) {
+    parent.Propagate({0, 0, 0, old_size - size}, false);
+  }
+
+  return Status::kOk;
+}
+
+void FileSystem::Release(FileData &data) {
+  for (const auto &extent : data.extents) {
+    Release(extent);
+  }
+  data.extents.clear();
+}
+
+void FileSystem::Release(const BlockDevice::Extent &extent) {
+  cache_.Discard(extent);
+  device_.Release(extent);
+}
+
+void FileSystem::WriteBytes(const FileData &data, std::uint64_t offset, const char *in, std::size_t length) {
+  std::vector<char> buffer(BlockDevice::kBlockSize);
+
+  auto index = offset / BlockDevice::kBlockSize;
+  auto within = static_cast<std::size_t>(offset % BlockDevice::kBlockSize);
+
+  std::size_t extent = 0;
+  std::uint64_t base = 0;
+  for (std::size_t done = 0; done < length; index++, within = 0) {
+    while (index >= base + (std::uint64_t{1} << data.extents[extent].order)) {
+      base += std::uint64_t{1} << data.extents[extent].order;
+      extent++;
+    }
+
+    auto block = data.extents[extent].start + (index - base);
+    auto count = std::min(BlockDevice::kBlockSize - within, length - done);
+    if (count < BlockDevice::kBlockSize) {
+      cache_.Read(block, buffer.data());
+    }
+
+    std::copy(in + done, in + done + count, buffer.data() + within);
+    cache_.Write(block, buffer.data());
+    done += count;
+  }
+}
+
+void FileSystem::Detach(Directory &parent, std::vector<FileOrDirectory>::iterator it) {
+  auto key = it->Key();
+  auto subtree = it->IsDirectory() ? it->Files() : nullptr;
+  auto data = it->Data();
+
+  parent.Erase(it);
+  index_.Erase(&parent, key);
+
+  if (subtree) {
+    Teardown(std::move(subtree));
+  }
+  if (data) {
+    Release(*data);
+  }
+}
+
+void FileSystem::Teardown(std::shared_ptr<Directory> directory) {
+  // A detached subtree is gathered with an explicit stack, dropped from the
+  // name index and then emptied level by level, so no entry is erased from
+  // a vector and no destructor recurses through a deep tree.
+  std::vector<std::shared_ptr<Directory>> directories{std::move(directory)};
+  for (std::size_t i = 0; i < directories.size(); i++) {
+    for (const auto &entry : directories[i]->Entries()) {
+      if (entry.IsDirectory()) {
+        directories.push_back(entry.Files());
+      }
+    }
+  }
+
+  index_.EraseTree(directories);
+
+  if (!hosts_.empty()) {
+    for (const auto &current : directories) {
+      Forget(current.get());
+    }
+  }
+
+  for (auto &current : directories) {
+    for (const auto &entry : current->Entries()) {
+      if (auto data = entry.Data()) {
+        Release(*data);
+      }
+    }
+    current->Clear();
+  }
+}
+
+FileSystem::Status FileSystem::Mutate(const Journal::Record &record) {
+  // Once the journal has lost records, nothing more is changed until a
+  // sync has saved the whole tree in a checkpoint.
+  if (journal_ && journal_->IsFailed()) {
+    return Status::kIoError;
+  }
+
+  std::shared_ptr<Directory> files = root_;
+  if (record.operation != Journal::Operation::kMakeDirectories) {
+    std::vector<std::string> cwd{"/"};
+    cwd.insert(cwd.end(), record.parent.begin(), record.parent.end());
+    files = Resolve(cwd);
+  }
+
+  if (!files) {
+    return Status::kNotFound;
+  }
+
+  if (!hosts_.empty()) {
+    auto status = CheckHost(record, files);
+    if (status != Status::kOk) {
+      return status;
+    }
+  }
+
+  auto status = Apply(record, files);
+  if (status != Status::kOk || !journal_) {
+    return status;
+  }
+
+  journal_->Append(record);
+  if (journal_->RecordsSinceReset() >= checkpoint_due_) {
+    Checkpoint();
+  }
+
+  return status;
+}
+
+FileSystem::Status FileSystem::MakeDirectory(const std::vector<std::string> &path, bool parents) {
+  if (path.size() < 2) {
+    return Status::kExists;
+  }
+
+  auto operation = parents ? Journal::Operation::kMakeDirectories : Journal::Operation::kMakeDirectory;
+  return Mutate({operation, {path.begin() + 1, path.end() - 1}, path.back(), 0, {}, 0});
+}
+
+FileSystem::Status FileSystem::Remove(const std::vector<std::string> &path, bool recursive) {
+  if (path.size() < 2) {
+    return Status::kIsDirectory;
+  }
+
+  auto operation = recursive ? Journal::Operation::kRemoveTree : Journal::Operation::kRemove;
+  auto status = Mutate({operation, {path.begin() + 1, path.end() - 1}, path.back(), 0, {}, 0});
+  if (status == Status::kNotFound && !recursive && Resolve(path)) {
+    return Status::kIsDirectory;
+  }
+
+  return status;
+}
+
+FileSystem::Status FileSystem::ChangeMode(const std::vector<std::string> &path, unsigned char mode, bool recursive) {
+  if (path.size() < 2) {
+    return Status::kNotFound;
+  }
+
+  auto operation = recursive ? Journal::Operation::kChangeModeTree : Journal::Operation::kChangeMode;
+  return Mutate({operation, {path.begin() + 1, path.end() - 1}, path.back(), mode, {}, 0});
+}
+
+FileSystem::Status FileSystem::CreateFile(const std::vector<std::string> &path) {
+  if (path.size() < 2) {
+    return Status::kIsDirectory;
+  }
+
+  return Mutate({Journal::Operation::kCreateFile, {path.begin() + 1, path.end() - 1}, path.back(), 0, {}, 0});
+}
+
+FileSystem::Status FileSystem::WriteFile(const std::vector<std::string> &path, const std::string &data, bool append) {
+  if (path.size() < 2) {
+    return Status::kIsDirectory;
+  }
+
+  auto operation = append ? Journal::Operation::kAppendFile : Journal::Operation::kWriteFile;
+  return Mutate({operation, {path.begin() + 1, path.end() - 1}, path.back(), 0, data, 0});
+}
+
+FileSystem::Status FileSystem::Truncate(const std::vector<std::string> &path, std::uint64_t size) {
+  if (path.size() < 2) {
+    return Status::kIsDirectory;
+  }
+
+  return Mutate({Journal::Operation::kTruncate, {path.begin() + 1, path.end() - 1}, path.back(), 0, {}, size});
+}
+
+FileSystem::Status FileSystem::ReadFile(const std::vector<std::string> &path,
+                                        const std::function<void(const char *, std::size_t)> &func) {
+  if (path.size() < 2) {
+    return Status::kIsDirectory;
+  }
+
+  auto files = Resolve({path.begin(), path.end() - 1});
+  auto key = NameTable::Global().Find(path.back());
+  if (!files || key == NameTable::kMissing) {
+    return Status::kNotFound;
+  }
+
+  auto it = files->Find(key);
+  if (it == files->Entries().end()) {
+    return Status::kNotFound;
+  }
+  if (it->IsDirectory()) {
+    return Status::kIsDirectory;
+  }
+
+#if defined(__linux__)
+  if (IsHost(files.get())) {
+    int fd = open((hosts_[files.get()].path + '/' + path.back()).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return Status::kNotFound;
+    }
+
+    std::vector<char> buffer(1 << 16);
+    for (ssize_t count; (count = read(fd, buffer.data(), buffer.size())) > 0;) {
+      func(buffer.data(), static_cast<std::size_t>(count));
+    }
+    close(fd);
+    return Status::kOk;
+  }
+#endif
+
+  auto data = it->Data();
+  if (!data) {
+    return Status::kOk;
+  }
+
+  // The whole file is read front to back, so the read-ahead window
+  // starts small and doubles up to its cap, restarting at each extent
+  // since the next one lies elsewhere on the device.
+  std::vector<char> buffer(BlockDevice::kBlockSize);
+  auto remaining = data->size;
+  std::size_t window = kReadAheadMin;
+  for (const auto &extent : data->extents) {
+    auto end = extent.start + (std::uint64_t{1} << extent.order);
+    auto ahead = extent.start;
+    for (auto block = extent.start; block < end && remaining > 0; block++) {
+      if (block >= ahead) {
+        auto blocks_left = (remaining + BlockDevice::kBlockSize - 1) / BlockDevice::kBlockSize;
+        auto count = std::min<std::uint64_t>({window, end - block, blocks_left});
+        cache_.ReadAhead(block, count);
+        ahead = block + count;
+        window = std::min(window * 2, kReadAheadMax);
+      }
+
+      auto count = static_cast<std::size_t>(std::min<std::uint64_t>(remaining, BlockDevice::kBlockSize));
+      cache_.Read(block, buffer.data());
+      func(buffer.data(), count);
+      remaining -= count;
+    }
+  }
+  return Status::kOk;
+}
+
+FileSystem::Status FileSystem::Sync() {
+  cache_.Flush();
+  if (!journal_ || journal_->Commit()) {
+    return Status::kOk;
+  }
+
+  Checkpoint();
+  return journal_->IsFailed() ? Status::kIoError : Status::kOk;
+}
+
+const BlockDevice &FileSystem::Device() const {
+  return device_;
+}
+
+const PageCache &FileSystem::Cache() const {
+  return cache_;
+}
+
+std::shared_ptr<Directory> FileSystem::Resolve(const std::vector<std::string> &cwd) {
+  auto files = root_;
+
+  bool has_hosts = !hosts_.empty();
+  if (has_hosts) {
+    PollHost();
+  }
+
+  const auto &table = NameTable::Global();
+  for (std::size_t i = 1; i < cwd.size(); i++) {
+    if (has_hosts) {
+      Materialize(files);
+    }
+
+    auto key = table.Find(cwd[i]);
+    if (key == NameTable::kMissing) {
+      return nullptr;
+    }
+
+    auto it = files->Find(key);
+    if (it == files->Entries().end() || !it->IsDirectory()) {
+      return nullptr;
+    }
+    files = it->Files();
+  }
+
+  if (has_hosts) {
+    Materialize(files);
+  }
+
+  return files;
+}
+
+bool FileSystem::IsHost(const Directory *directory) const {
+  return !hosts_.empty() && hosts_.count(directory) != 0;
+}
+
+FileSystem::Status FileSystem::CheckHost(const Journal::Record &record, const std::shared_ptr<Directory> &files) {
+  std::vector<std::string> path{"/"};
+  path.insert(path.end(), record.parent.begin(), record.parent.end());
+
+  switch (record.operation) {
+    case Journal::Operation::kMakeDirectories: {
+      // files is the root here, so every existing prefix is looked at.
+      path.push_back(record.name);
+      if (Resolve(path)) {
+        return Status::kExists;
+      }
+
+      for (std::size_t i = 1; i < path.size(); i++) {
+        auto directory = Resolve({path.begin(), path.begin() + i});
+        if (!directory) {
+          break;
+        }
+        if (IsHost(directory.get())) {
+          return Status::kReadOnly;
+        }
+      }
+      return Status::kOk;
+    }
+    case Journal::Operation::kRemoveTree: {
+      if (IsHost(files.get())) {
+        return Status::kReadOnly;
+      }
+
+      path.push_back(record.name);
+      auto target = Resolve(path);
+      for (const auto *mount : mounts_) {
+        for (const auto *directory = mount; target && directory != nullptr; directory = directory->Parent()) {
+          if (directory == target.get()) {
+            return Status::kBusy;
+          }
+        }
+      }
+      return Status::kOk;
+    }
+    case Journal::Operation::kChangeModeTree: {
+      // Mounts below the target are skipped by Apply, but a mount point
+      // named directly would have nothing changed except itself.
+      if (IsHost(files.get())) {
+        return Status::kReadOnly;
+      }
+
+      path.push_back(record.name);
+      auto target = Resolve(path);
+      return target && IsHost(target.get()) ? Status::kReadOnly : Status::kOk;
+    }
+    default:
+      return IsHost(files.get()) ? Status::kReadOnly : Status::kOk;
+  }
+}
+
+#if defined(__linux__)
+namespace {
+
+struct HostDirent {
+  std::uint64_t inode;
+  std::int64_t offset;
+  unsigned short length;
+  unsigned char type;
+  char name[1];
+};
+
+bool ListHostDirectory(const std::string &path, std::vector<std::pair<std::string, bool>> &listing) {
+  int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+
+  std::vector<char> buffer(1 << 16);
+  for (;;) {
+    auto count = syscall(SYS_getdents64, fd, buffer.data(), buffer.size());
+    if (count <= 0) {
+      break;
+    }
+
+    for (long offset = 0; offset < count;) {
+      const auto *entry = reinterpret_cast<const HostDirent *>(buffer.data() + offset);
+      offset += entry->length;
+
+      std::string name{entry->name};
+      if (name == "." || name == "..") {
+        continue;
+      }
+
+      // Symbolic links are followed, so a linked directory can be entered.
+      bool is_directory = entry->type == DT_DIR;
+      if (entry->type == DT_UNKNOWN || entry->type == DT_LNK) {
+        struct stat status{};
+        is_directory = fstatat(fd, entry->name, &status, 0) == 0 && S_ISDIR(status.st_mode);
+      }
+      listing.emplace_back(std::move(name), is_directory);
+    }
+  }
+
+  close(fd);
+  return true;
+}
+
+}
+#endif
+
+void FileSystem::Materialize(const std::shared_ptr<Directory> &directory) {
+#if defined(__linux__)
+  auto it = hosts_.find(directory.get());
+  if (it == hosts_.end() || (it->second.is_loaded && !it->second.is_stale)) {
+    return;
+  }
+
+  // The watch goes in before the listing, so a change that races with it
+  // still marks the directory stale.
+  auto &host = it->second;
+  if (host.watch < 0) {
+    host.watch = inotify_add_watch(inotify_fd_, host.path.c_str(),
+                                   IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF |
+                                   IN_MOVE_SELF | IN_ONLYDIR);
+    if (host.watch >= 0) {
+      watches_[host.watch].push_back(directory.get());
+    }
+  }
+
+  std::vector<std::pair<std::string, bool>> listing;
+  ListHostDirectory(host.path, listing);
+
+  std::unordered_set<std::uint64_t> listed;
+  for (const auto &[name, is_directory] : listing) {
+    listed.insert(std::uint64_t{NameTable::Global().Intern(name)} << 1 | (is_directory ? 1 : 0));
+  }
+
+  // Entries that are still there keep whatever was materialized below
+  // them; only vanished ones are dropped and only new ones are added.
+  for (auto i = directory->Entries().size(); i-- > 0;) {
+    auto entries = directory->Entries();
+    auto entry_key = std::uint64_t{entries[i].Key()} << 1 | (entries[i].IsDirectory() ? 1 : 0);
+    if (listed.erase(entry_key) == 0) {
+      Detach(*directory, entries.begin() + i);
+    }
+  }
+
+  auto path = host.path;
+  bool is_watched = host.watch >= 0;
+  host.is_loaded = true;
+  host.is_stale = !is_watched;
+
+  for (const auto &[name, is_directory] : listing) {
+    auto key = std::uint64_t{NameTable::Global().Find(name)} << 1 | (is_directory ? 1 : 0);
+    if (listed.erase(key) == 0) {
+      continue;
+    }
+
+    auto entry = is_directory ? FileOrDirectory::CreateDirectory(name) : FileOrDirectory::CreateFile(name);
+    entry.SetPermission(is_directory ? READ_FLAG | EXECUTE_FLAG : READ_FLAG);
+    if (is_directory) {
+      hosts_[entry.Files().get()].path = path + '/' + name;
+    }
+
+    directory->Add(entry);
+    index_.Insert(directory.get(), entry.Key());
+  }
+#endif
+}
+
+void FileSystem::PollHost() {
+#if defined(__linux__)
+  if (watches_.empty()) {
+    return;
+  }
+
+  alignas(inotify_event) char buffer[1 << 14];
+  for (;;) {
+    auto count = read(inotify_fd_, buffer, sizeof(buffer));
+    if (count <= 0) {
+      break;
+    }
+
+    for (ssize_t offset = 0; offset < count;) {
+      const auto *event = reinterpret_cast<const inotify_event *>(buffer + offset);
+      offset += sizeof(inotify_event) + event->len;
+
+      auto watch = watches_.find(event->wd);
+      if (watch == watches_.end()) {
+        continue;
+      }
+
+      for (const auto *directory : watch->second) {
+        auto &host = hosts_[directory];
+        host.is_stale = true;
+        if (event->mask & IN_IGNORED) {
+          host.watch = -1;
+        }
+      }
+
+      if (event->mask & IN_IGNORED) {
+        watches_.erase(watch);
+      }
+    }
+  }
+#endif
+}
+
+void FileSystem::Forget(const Directory *directory) {
+  auto it = hosts_.find(directory);
+  if (it == hosts_.end()) {
+    return;
+  }
+
+#if defined(__linux__)
+  auto watch = watches_.find(it->second.watch);
+  if (watch != watches_.end()) {
+    auto &directories = watch->second;
+    directories.erase(std::remove(directories.begin(), directories.end(), directory), directories.end());
+    if (directories.empty()) {
+      inotify_rm_watch(inotify_fd_, watch->first);
+      watches_.erase(watch);
+    }
+  }
+#endif
+
+  hosts_.erase(it);
+  mounts_.erase(std::remove(mounts_.begin(), mounts_.end(), directory), mounts_.end());
+}
+
+FileSystem::Status FileSystem::Mount(const std::string &host_path, const std::vector<std::string> &path) {
+#if defined(__linux__)
+  auto directory = Resolve(path);
+  if (!directory) {
+    return Status::kNotFound;
+  }
+  if (IsHost(directory.get())) {
+    return Status::kBusy;
+  }
+  if (!directory->Entries().empty()) {
+    return Status::kExists;
+  }
+
+  struct stat status{};
+  if (stat(host_path.c_str(), &status) != 0 || !S_ISDIR(status.st_mode)) {
+    return Status::kNotFound;
+  }
+
+  if (inotify_fd_ < 0) {
+    inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  }
+
+  hosts_[directory.get()].path = host_path == "/" ? "" : host_path;
+  mounts_.push_back(directory.get());
+  return Status::kOk;
+#else
+  return Status::kUnsupported;
+#endif
+}
+
+FileSystem::Status FileSystem::Unmount(const std::vector<std::string> &path) {
+  if (path.size() < 2) {
+    return Status::kNotFound;
+  }
+
+  // The mount point is looked up in its parent so that unmounting does not
+  // list the host directory first.
+  auto parent = Resolve({path.begin(), path.end() - 1});
+  auto key = NameTable::Global().Find(path.back());
+  if (!parent || key == NameTable::kMissing) {
+    return Status::kNotFound;
+  }
+
+  auto it = parent->Find(key);
+  if (it == parent->Entries().end() || !it->IsDirectory()) {
+    return Status::kNotFound;
+  }
+
+  auto directory = it->Files();
+  if (std::find(mounts_.begin(), mounts_.end(), directory.get()) == mounts_.end()) {
+    return Status::kNotFound;
+  }
+
+  while (!directory->Entries().empty()) {
+    Detach(*directory, directory->Entries().end() - 1);
+  }
+  Forget(directory.get());
+  return Status::kOk;
+}
+
+std::vector<std::pair<std::string, std::string>> FileSystem::Mounts() const {
+  std::vector<std::pair<std::string, std::string>> mounts;
+  for (const auto *directory : mounts_) {
+    const auto &host_path = hosts_.at(directory).path;
+    mounts.emplace_back(host_path.empty() ? "/" : host_path, PathOf(directory));
+  }
+
+  return mounts;
+}
+
+void FileSystem::TraverseDirectory(const std::vector<std::string> &cwd, const std::function<void(std::shared_ptr<Directory>)> &func) {
+  auto files = Resolve(cwd);
+  if (files) {
+    func(files);
+  }
+}
+
+static std::vector<std::string> JoinPath(const std::vector<std::string> &cwd, const std::string &path) {
+  std::vector<std::string> joined{"/"};
+  if (path.empty() || path[0] != '/') {
+    joined = cwd;
+  }
+
+  std::size_t begin = 0;
+  while (begin <= path.size()) {
+    auto end = path.find('/', begin);
+    if (end == std::string::npos) {
+      end = path.size();
+    }
+
+    auto component = path.substr(begin, end - begin);
+    if (component == "..") {
+      if (joined.size() > 1) {
+        joined.pop_back();
+      }
+    } else if (!component.empty() && component != ".") {
+      joined.push_back(component);
+    }
+
+    begin = end + 1;
+  }
+
+  return joined;
+}
+
+class Command {
+public:
+  virtual ~Command() = default;
+
+  virtual void Execute(Shell&) = 0;
+};
+
+// Streams one JSON object per record straight into an output stream's
+// buffer, either as the elements of a single array (--json) or one per
+// line (--ndjson). Nothing is allocated per record, and the output
+// reaches the stream in fixed-size chunks, so a consumer can start
+// parsing long before a large listing is finished.
+class RecordWriter {
+public:
+  RecordWriter(std::ostream &, OutputFormat);
+  ~RecordWriter();
+
+  void BeginRecord();
+  void Field(std::string_view, std::string_view);
+  void Field(std::string_view, const char *);
+
+  template <typename T, typename = std::enable_if_t<std::is_integral_v<T>>>
+  void Field(std::string_view key, T value) {
+    Key(key);
+    auto *cursor = Reserve(24);
+    size_ = std::to_chars(cursor, cursor + 24, value).ptr - buffer_;
+  }
+
+  void EndRecord();
+
+private:
+  void Key(std::string_view);
+  void Escaped(std::string_view);
+  void Write(std::string_view);
+  static std::size_t Utf8Length(std::string_view);
+  char *Reserve(std::size_t);
+
+private:
+  static constexpr std::size_t kBufferSize = 1 << 14;
+  // Longest run of a value escaped at once: every byte may grow to a
+  // six byte \u00XX or \ufffd sequence, and the last character may run
+  // up to three bytes past it.
+  static constexpr std::size_t kEscapeChunk = kBufferSize / 8;
+
+  std::streambuf *out_;
+  OutputFormat format_;
+  std::size_t records_{0};
+  bool has_fields_{false};
+
+  std::size_t size_{0};
+  char buffer_[kBufferSize];
+};
+
+RecordWriter::RecordWriter(std::ostream &out, OutputFormat format) : out_{out.rdbuf()}, format_{format} {
+  if (format_ == OutputFormat::kJson) {
+    Write("[");
+  }
+}
+
+RecordWriter::~RecordWriter() {
+  if (format_ == OutputFormat::kJson) {
+    Write(records_ == 0 ? "]\n" : "\n]\n");
+  }
+  out_->sputn(buffer_, static_cast<std::streamsize>(size_));
+}
+
+void RecordWriter::BeginRecord() {
+  if (format_ == OutputFormat::kJson) {
+    Write(records_ == 0 ? "\n{" : ",\n{");
+  } else {
+    Write("{");
+  }
+  has_fields_ = false;
+}
+
+void RecordWriter::Field(std::string_view key, std::string_view value) {
+  Key(key);
+  Escaped(value);
+}
+
+void RecordWriter::Field(std::string_view key, const char *value) {
+  Field(key, std::string_view{value});
+}
+
+void RecordWriter::EndRecord() {
+  Write(format_ == OutputFormat::kNdjson ? "}\n" : "}");
+  records_++;
+}
+
+void RecordWriter::Key(std::string_view key) {
+  // Keys are literals chosen by the commands and never need escaping.
+  auto *cursor = Reserve(key.size() + 4);
+  if (has_fields_) {
+    *cursor++ = ',';
+  }
+  has_fields_ = true;
+
+  *cursor++ = '"';
+  std::memcpy(cursor, key.data(), key.size());
+  cursor += key.size();
+  *cursor++ = '"';
+  *cursor++ = ':';
+  size_ = cursor - buffer_;
+}
+
+// Writes the value as a quoted string. Bytes are copied through a local
+// cursor and the buffer size is stored once per chunk; updating the member
+// per byte would force a reload after every store, since the char buffer
+// may alias it.
+void RecordWriter::Escaped(std::string_view value) {
+  static constexpr char kHex[] = "0123456789abcdef";
+
+  Write("\"");
+  while (!value.empty()) {
+    auto chunk = std::min(value.size(), kEscapeChunk);
+    auto *cursor = Reserve(6 * (chunk + 3));
+
+    std::size_t i = 0;
+    while (i < chunk) {
+      auto c = static_cast<unsigned char>(value[i]);
+      if (c >= 0x20 && c < 0x80 && c != '"' && c != '\\') {
+        *cursor++ = static_cast<char>(c);
+        i++;
+        continue;
+      }
+
+      // Names are arbitrary bytes; anything that is not well-formed UTF-8
+      // goes out one byte at a time as U+FFFD so the document stays valid.
+      if (c >= 0x80) {
+        auto length = Utf8Length(value.substr(i));
+        if (length == 0) {
+          std::memcpy(cursor, "\\ufffd", 6);
+          cursor += 6;
+          i++;
+        } else {
+          std::memcpy(cursor, value.data() + i, length);
+          cursor += length;
+          i += length;
+        }
+        continue;
+      }
+      i++;
+
+      *cursor++ = '\\';
+      switch (c) {
+        case '"':
+        case '\\':
+          *cursor++ = static_cast<char>(c);
+          break;
+        case '\n':
+          *cursor++ = 'n';
+          break;
+        case '\t':
+          *cursor++ = 't';
+          break;
+        case '\r':
+          *cursor++ = 'r';
+          break;
+        default:
+          *cursor++ = 'u';
+          *cursor++ = '0';
+          *cursor++ = '0';
+          *cursor++ = kHex[c >> 4];
+          *cursor++ = kHex[c & 0xF];
+          break;
+      }
+    }
+
+    size_ = cursor - buffer_;
+    value.remove_prefix(i);
+  }
+  Write("\"");
+}
+
+// Length of the well-formed UTF-8 sequence value starts with, or 0 when it
+// does not start with one. Overlong forms, surrogates and code points past
+// U+10FFFF are rejected.
+std::size_t RecordWriter::Utf8Length(std::string_view value) {
+  auto lead = static_cast<unsigned char>(value[0]);
+  std::size_t length = 0;
+  unsigned char low = 0x80;
+  unsigned char high = 0xBF;
+  if (lead >= 0xC2 && lead <= 0xDF) {
+    length = 2;
+  } else if (lead >= 0xE0 && lead <= 0xEF) {
+    length = 3;
+    low = lead == 0xE0 ? 0xA0 : low;
+    high = lead == 0xED ? 0x9F : high;
+  } else if (lead >= 0xF0 && lead <= 0xF4) {
+    length = 4;
+    low = lead == 0xF0 ? 0x90 : low;
+    high = lead == 0xF4 ? 0x8F : high;
+  }
+  if (length == 0 || value.size() < length) {
+    return 0;
+  }
+
+  auto second = static_cast<unsigned char>(value[1]);
+  if (second < low || second > high) {
+    return 0;
+  }
+  for (std::size_t i = 2; i < length; i++) {
+    if ((static_cast<unsigned char>(value[i]) & 0xC0) != 0x80) {
+      return 0;
+    }
+  }
+
+  return length;
+}
+
+void RecordWriter::Write(std::string_view text) {
+  auto *cursor = Reserve(text.size());
+  std::memcpy(cursor, text.data(), text.size());
+  size_ += text.size();
+}
+
+// Returns room for at least the given number of bytes, handing the
+// buffered output to the stream first when it would not fit.
+char *RecordWriter::Reserve(std::size_t length) {
+  if (size_ + length > kBufferSize) {
+    out_->sputn(buffer_, static_cast<std::streamsize>(size_));
+    size_ = 0;
+  }
+  return buffer_ + size_;
+}
+
+
+class LineEditor {
+public:
+  using Completer = std::function<Completion(const std::string &, bool)>;
+
+  LineEditor();
+
+  void SetCompleter(const Completer &);
+  void LoadHistory(const std::string &);
+
+  bool ReadLine(const std::string &, std::string &);
+
+private:
+  bool ReadRaw(const std::string &, std::string &);
+  void Refresh(const std::string &, const std::string &, std::size_t) const;
+  void Complete(const std::string &, std::string &, std::size_t &) const;
+  void AddHistory(const std::string &);
+  void SaveHistory();
+
+private:
+  static constexpr std::size_t kHistoryLimit = 1000;
+  // The file may hold this many lines before it is rewritten back down to
+  // kHistoryLimit, so a rewrite happens once per kHistoryLimit commands.
+  static constexpr std::size_t kHistoryFileLimit = 2 * kHistoryLimit;
+  static constexpr std::size_t kCompletionLimit = 100;
+
+  std::vector<std::string> history_;
+  std::string history_path_;
+  std::size_t history_file_lines_{0};
+
+  Completer completer_;
+};
+
+LineEditor::LineEditor() = default;
+
+void LineEditor::SetCompleter(const Completer &completer) {
+  completer_ = completer;
+}
+
+void LineEditor::LoadHistory(const std::string &path) {
+  history_path_ = path;
+  history_.clear();
+
+  std::ifstream history_file{path};
+  std::string line;
+  while (std::getline(history_file, line)) {
+    if (!line.empty()) {
+      history_.push_back(line);
+    }
+  }
+  history_file_lines_ = history_.size();
+
+  if (history_.size() > kHistoryLimit) {
+    history_.erase(history_.begin(), history_.end() - kHistoryLimit);
+  }
+  if (history_file_lines_ > kHistoryFileLimit) {
+    SaveHistory();
+  }
+}
+
+void LineEditor::AddHistory(const std::string &input) {
+  auto line = input.substr(0, input.find_last_not_of(" \t\r") + 1);
+  if (line.empty() || (!history_.empty() && history_.back() == line)) {
+    return;
+  }
+
+  history_.push_back(line);
+  if (history_.size() > kHistoryLimit) {
+    history_.erase(history_.begin());
+  }
+
+  if (history_path_.empty()) {
+    return;
+  }
+
+  // Lines are appended as they come; a line that would take the file past
+  // kHistoryFileLimit rewrites it from memory instead.
+  if (history_file_lines_ >= kHistoryFileLimit) {
+    SaveHistory();
+    return;
+  }
+
+  std::ofstream history_file{history_path_, std::ios::app};
+  history_file << line << '\n';
+  history_file_lines_++;
+}
+
+void LineEditor::SaveHistory() {
+  auto temporary = history_path_ + ".tmp";
+  {
+    std::ofstream history_file{temporary, std::ios::trunc};
+    for (const auto &line : history_) {
+      history_file << line << '\n';
+    }
+    if (!history_file) {
+      return;
+    }
+  }
+
+  if (std::rename(temporary.c_str(), history_path_.c_str()) == 0) {
+    history_file_lines_ = history_.size();
+  }
+}
+
+bool LineEditor::ReadLine(const std::string &prompt, std::string &line) {
+#if !defined(_WIN32)
+  if (isatty(STDIN_FILENO)) {
+    return ReadRaw(prompt, line);
+  }
+#endif
+
+  std::cout << prompt;
+  if (!std::getline(std::cin, line)) {
+    return false;
+  }
+
+  return true;
+}
+
+void LineEditor::Refresh(const std::string &prompt, const std::string &line, std::size_t cursor) const {
+  std::cout << '\r' << prompt << line << "\x1b[K\r";
+  if (prompt.size() + cursor > 0) {
+    std::cout << "\x1b[" << prompt.size() + cursor << 'C';
+  }
+  std::cout.flush();
+}
+
+void LineEditor::Complete(const std::string &prompt, std::string &line, std::size_t &cursor) const {
+  if (!completer_) {
+    return;
+  }
+
+  auto word_begin = line.rfind(' ', cursor == 0 ? 0 : cursor - 1);
+  word_begin = (word_begin == std::string::npos || word_begin >= cursor) ? 0 : word_begin + 1;
+  auto word = line.substr(word_begin, cursor - word_begin);
+
+  bool is_command = line.find_first_not_of(' ') >= word_begin;
+
+  auto completion = completer_(word, is_command);
+  if (completion.candidates.empty()) {
+    std::cout << '\a' << std::flush;
+    return;
+  }
+
+  auto insertion = completion.common_prefix.substr(word.size());
+  if (completion.candidates.size() == 1 && !completion.truncated) {
+    insertion += ' ';
+  }
+
+  if (!insertion.empty()) {
+    line.insert(cursor, insertion);
+    cursor += insertion.size();
+    Refresh(prompt, line, cursor);
+    return;
+  }
+
+  std::cout << "\r\n";
+  for (const auto &candidate : completion.candidates) {
+    std::cout << candidate << "  ";
+  }
+  if (completion.truncated) {
+    std::cout << "...";
+  }
+  std::cout << "\r\n";
+
+  Refresh(prompt, line, cursor);
+}
+
+bool LineEditor::ReadRaw(const std::string &prompt, std::string &line) {
+#if defined(_WIN32)
+  return false;
+#else
+  termios original{};
+  if (tcgetattr(STDIN_FILENO, &original) == -1) {
+    std::cout << prompt;
+    return static_cast<bool>(std::getline(std::cin, line));
+  }
+
+  termios raw = original;
+  raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+  raw.c_cflag |= CS8;
+  // ISIG is off as well: Ctrl-C and Ctrl-Z arrive as keys instead of
+  // killing or stopping the process with the terminal left raw.
+  raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+
+  std::string buffer;
+  std::string pending;
+  std::size_t cursor = 0;
+  std::size_t history_index = history_.size();
+  bool is_eof = false;
+
+  Refresh(prompt, buffer, cursor);
+
+  while (true) {
+    char c;
+    if (read(STDIN_FILENO, &c, 1) <= 0) {
+      is_eof = true;
+      break;
+    }
+
+    if (c == '\r' || c == '\n') {
+      break;
+    }
+
+    switch (c) {
+      case '\t':
+        Complete(prompt, buffer, cursor);
+        continue;
+      case 127:
+      case 8:
+        if (cursor > 0) {
+          buffer.erase(--cursor, 1);
+        }
+        break;
+      case 3:
+        std::cout << "^C\r\n";
+        buffer.clear();
+        pending.clear();
+        cursor = 0;
+        history_index = history_.size();
+        break;
+      case 26:
+        std::cout << '\a' << std::flush;
+        continue;
+      case 4:
+        if (buffer.empty()) {
+          is_eof = true;
+        } else if (cursor < buffer.size()) {
+          buffer.erase(cursor, 1);
+        }
+        break;
+      case 1:
+        cursor = 0;
+        break;
+      case 5:
+        cursor = buffer.size();
+        break;
+      case 11:
+        buffer.erase(cursor);
+        break;
+      case 21:
+        buffer.erase(0, cursor);
+        cursor = 0;
+        break;
+      case 27: {
+        char seq[2];
+        if (read(STDIN_FILENO, &seq[0], 1) <= 0 || read(STDIN_FILENO, &seq[1], 1) <= 0) {
+          break;
+        }
+
+        if (seq[0] != '[') {
+          break;
+        }
+
+        if (seq[1] == 'A' && history_index > 0) {
+          if (history_index == history_.size()) {
+            pending = buffer;
+          }
+          buffer = history_[--history_index];
+          cursor = buffer.size();
+        } else if (seq[1] == 'B' && history_index < history_.size()) {
+          history_index++;
+          buffer = history_index == history_.size() ? pending : history_[history_index];
+          cursor = buffer.size();
+        } else if (seq[1] == 'C' && cursor < buffer.size()) {
+          cursor++;
+        } else if (seq[1] == 'D' && cursor > 0) {
+          cursor--;
+        } else if (seq[1] == 'H') {
+          cursor = 0;
+        } else if (seq[1] == 'F') {
+          cursor = buffer.size();
+        } else if (seq[1] == '3') {
+          char tilde;
+          if (read(STDIN_FILENO, &tilde, 1) > 0 && tilde == '~' && cursor < buffer.size()) {
+            buffer.erase(cursor, 1);
+          }
+        }
+        break;
+      }
+      default:
+        if (std::isprint(static_cast<unsigned char>(c))) {
+          buffer.insert(cursor++, 1, c);
+        }
+        break;
+    }
+
+    if (is_eof) {
+      break;
+    }
+
+    Refresh(prompt, buffer, cursor);
+  }
+
+  tcsetattr(STDIN_FILENO, TCSAFLUSH, &original);
+  std::cout << '\n';
+
+  if (is_eof) {
+    return false;
+  }
+
+  line = buffer;
+  AddHistory(line);
+  return true;
+#endif
+}
+
+class CaptureBuffer : public std::streambuf {
+public:
+  explicit CaptureBuffer(std::streambuf *);
+
+  const std::string &Captured() const;
+
+protected:
+  int_type overflow(int_type) override;
+  std::streamsize xsputn(const char *, std::streamsize) override;
+  int sync() override;
+
+private:
+  std::streambuf *target_;
+  std::string captured_;
+};
+
+CaptureBuffer::CaptureBuffer(std::streambuf *target) : target_{target} {}
+
+const std::string &CaptureBuffer::Captured() const {
+  return captured_;
+}
+
+CaptureBuffer::int_type CaptureBuffer::overflow(int_type c) {
+  if (traits_type::eq_int_type(c, traits_type::eof())) {
+    return traits_type::not_eof(c);
+  }
+
+  captured_.push_back(traits_type::to_char_type(c));
+  return target_->sputc(traits_type::to_char_type(c));
+}
+
+std::streamsize CaptureBuffer::xsputn(const char *data, std::streamsize count) {
+  captured_.append(data, static_cast<std::size_t>(count));
+  return target_->sputn(data, count);
+}
+
+int CaptureBuffer::sync() {
+  return target_->pubsync();
+}
+
+class SessionRecorder {
+public:
+  struct Entry {
+    std::uint64_t offset;
+    std::string line;
+    std::string output;
+    std::uint64_t duration;
+  };
+
+  struct Recording {
+    std::string login;
+    std::int64_t started;
+    std::string snapshot;
+    std::vector<Entry> entries;
+  };
+
+  static std::unique_ptr<SessionRecorder> Create(const std::string &, const std::string &,
+                                                 const std::chrono::time_point<std::chrono::system_clock> &,
+                                                 const std::string &);
+  static bool Load(const std::string &, Recording &);
+
+  ~SessionRecorder();
+
+  void Capture(Shell &, const std::string &);
+
+private:
+  explicit SessionRecorder(std::FILE *);
+
+private:
+  static constexpr char kMagic[4] = {'P', 'S', 'E', 'S'};
+
+  std::FILE *file_;
+  std::chrono::steady_clock::time_point started_;
+};
+
+SessionRecorder::SessionRecorder(std::FILE *file) : file_{file}, started_{std::chrono::steady_clock::now()} {}
+
+SessionRecorder::~SessionRecorder() {
+  std::fclose(file_);
+}
+
+std::unique_ptr<SessionRecorder> SessionRecorder::Create(
+    const std::string &path, const std::string &login,
+    const std::chrono::time_point<std::chrono::system_clock> &time_point, const std::string &snapshot) {
+  auto *file = std::fopen(path.c_str(), "wb");
+  if (file == nullptr) {
+    return nullptr;
+  }
+
+  // The machine clock and the tree as they were when the session began,
+  // so a replay starts from exactly the same state.
+  std::string header{kMagic, sizeof(kMagic)};
+  PutString(header, login);
+  auto started = std::chrono::duration_cast<std::chrono::microseconds>(time_point.time_since_epoch()).count();
+  PutFixed(header, static_cast<std::uint64_t>(started), 8);
+  PutString(header, snapshot);
+
+  std::fwrite(header.data(), 1, header.size(), file);
+  std::fflush(file);
+
+  return std::unique_ptr<SessionRecorder>{new SessionRecorder{file}};
+}
+
+bool SessionRecorder::Load(const std::string &path, Recording &recording) {
+  std::string content;
+  if (!ReadWholeFile(path, content) || content.compare(0, sizeof(kMagic), kMagic, sizeof(kMagic)) != 0) {
+    return false;
+  }
+
+  const char *in = content.data() + sizeof(kMagic);
+  const char *end = content.data() + content.size();
+
+  std::uint64_t started;
+  if (!GetString(in, end, recording.login) || !GetFixed(in, end, started, 8) ||
+      !GetString(in, end, recording.snapshot)) {
+    return false;
+  }
+  recording.started = static_cast<std::int64_t>(started);
+
+  while (in < end) {
+    Entry entry;
+    if (!GetVarint(in, end, entry.offset) || !GetString(in, end, entry.line) ||
+        !GetString(in, end, entry.output) || !GetVarint(in, end, entry.duration)) {
+      break;
+    }
+    recording.entries.push_back(std::move(entry));
+  }
+
+  return true;
+}
+
+class Shell {
+public:
+  Shell(const Computer &);
+  Shell(const Computer &, const std::shared_ptr<FileSystem> &);
+
+  void MainLoop();
+  void Execute(const std::string &);
+  void Record(const std::string &);
+
+  void SetDateTime(const std::chrono::time_point<std::chrono::system_clock> &);
+
+  std::string Prompt() const;
+  void DisplayPrompt();
+
+  Completion Complete(const std::string &, bool);
+
+  bool IsAuthenticating();
+
+  void Shutdown();
+
+  void DetachTerminal();
+  bool HasTerminal() const;
+
+  void Go(const std::string &);
+  void Back();
+
+  std::vector<std::string> Cwd() {
+    return cwd_;
+  }
+
+  Argument Arg() const;
+  User CurrentUser() const;
+  std::chrono::time_point<std::chrono::system_clock> DateTime() const;
+  Computer GetComputer() const;
+
+private:
+  Shell();
+
+  static std::shared_ptr<FileSystem> OpenFileSystem(const Computer &);
+
+  std::vector<std::string> Tokenize(std::string);
+  void ParseArgs(const std::vector<std::string> &);
+  bool ContainsCommand(const std::string &);
+
+  bool IsRunning() const;
+
+private:
+  std::vector<User> users_;
+  User current_user_;
+
+  std::vector<std::string> cwd_;
+
+  bool is_running_;
+  bool has_terminal_{true};
+  std::unordered_map<std::string, std::unique_ptr<Command>> commands_;
+  PrefixIndex command_index_;
+  Argument arg_;
+
+  std::shared_ptr<FileSystem> fs_;
+  LineEditor line_editor_;
+
+  std::string record_path_;
+  std::unique_ptr<SessionRecorder> recorder_;
+
+  Computer computer_;
+};
+
+Computer Shell::GetComputer() const {
+  return computer_;
+}
+
+void Shell::Go(const std::string &path) {
+  cwd_.push_back(path);
+}
+
+void Shell::Back() {
+  cwd_.pop_back();
+}
+
+std::string Shell::Prompt() const {
+  std::string prompt = current_user_.Login() + '@' + "desktop:";
+  for (std::size_t i = 0; i < cwd_.size(); i++) {
+    if (i == 0 || i == cwd_.size() - 1) {
+      prompt += cwd_[i];
+    } else {
+      prompt += cwd_[i] + '/';
+    }
+  }
+
+  return prompt + "$ ";
+}
+
+void Shell::DisplayPrompt() {
+  std::cout << Prompt();
+}
+
+Completion Shell::Complete(const std::string &word, bool is_command) {
+  constexpr std::size_t limit = 100;
+
+  if (is_command) {
+    return command_index_.Complete(word, limit);
+  }
+
+  Completion completion;
+  fs_->TraverseDirectory(cwd_, [&](std::shared_ptr<Directory> files) {
+    completion = files->Index().Complete(word, limit);
+  });
+
+  return completion;
+}
+
+void Shell::SetDateTime(const std::chrono::time_point<std::chrono::system_clock> &time_point) {
+  computer_.SetDateTime(time_point);
+}
+
+std::chrono::time_point<std::chrono::system_clock> Shell::DateTime() const {
+  return computer_.TimePoint();
+}
+
+User Shell::CurrentUser() const {
+  return current_user_;
+}
+
+bool Shell::IsAuthenticating() {
+  std::string login;
+  std::string password;
+
+  std::cout << "login: ";
+  std::getline(std::cin, login);
+
+  std::cout << "password: ";
+  std::getline(std::cin, password);
+
+  for (const auto &user : users_) {
+    if (user.Login() == login && user.Password() == password) {
+      current_user_ = user;
+      return true;
+    }
+  }
+
+  std::cout << "invalid login\n";
+  return false;
+}
+
+class ShutdownCommand : public Command {
+public:
+  virtual void Execute(Shell &);
+};
+
+class ChangeDirectoryCommand : public Command {
+public:
+  ChangeDirectoryCommand(const std::shared_ptr<FileSystem> &);
+
+  virtual void Execute(Shell &);
+
+private:
+ std::shared_ptr<FileSystem> fs_;
+};
+
+ChangeDirectoryCommand::ChangeDirectoryCommand(const std::shared_ptr<FileSystem> &fs) : fs_{fs} {}
+
+void ChangeDirectoryCommand::Execute(Shell &shell) {
+  auto arg = shell.Arg();
+
+  if (!arg.HasParameters()) {
+    std::cout << arg.ProgramName() << ": missing operand\n";
+    return;
+  }
+
+  auto parameters = arg.Parameters();
+  auto target = parameters[0];
+
+  if (target == "..") {
+    if (shell.Cwd().size() == 1) {
+      return;
+    }
+
+    shell.Back();
+    return;
+  }
+
+  bool is_exists = false;
+  auto key = NameTable::Global().Find(target);
+
+  fs_->TraverseDirectory(shell.Cwd(), [&](std::shared_ptr<Directory> files) {
+    auto it = files->Find(key);
+    is_exists = it != files->Entries().end() && it->IsDirectory();
+  });
+
+  if (!is_exists) {
+    std::cout << arg.ProgramName() << ": no such file or directory\n";
+    return;
+  }
+
+  shell.Go(target);
+}
+
+class DateCommand : public Command {
+public:
+  virtual void Execute(Shell &);
+};
+
+class ListCommand : public Command {
+public:
+  ListCommand(const std::shared_ptr<FileSystem> &);
+
+  virtual void Execute(Shell &);
+
+private:
+  std::shared_ptr<FileSystem> fs_;
+};
+
+class RemoveCommand : public Command {
+public:
+  RemoveCommand(const std::shared_ptr<FileSystem> &);
+
+  virtual void Execute(Shell &);
+
+private:
+  std::shared_ptr<FileSystem> fs_;
+};
+
+RemoveCommand::RemoveCommand(const std::shared_ptr<FileSystem> &fs) : fs_{fs} {}
+
+ListCommand::ListCommand(const std::shared_ptr<FileSystem> &fs) : fs_{fs} {}
+
+class ChangeModeCommand : public Command {
+public:
+  ChangeModeCommand(const std::shared_ptr<FileSystem> &);
+
+  virtual void Execute(Shell &);
+
+private:
+  std::shared_ptr<FileSystem> fs_;
+};
+
+ChangeModeCommand::ChangeModeCommand(const std::shared_ptr<FileSystem> &fs) : fs_{fs} {}
+
+void ChangeModeCommand::Execute(Shell &shell) {
+  auto arg = shell.Arg();
+  auto parameters = arg.Parameters();
+
+  if (parameters.size() < 2) {
+    std::cout << arg.ProgramName() << ": not enough parameter\n";
+    return;
+  }
+
+  bool is_recursive = false;
+  for (const auto &option : arg.Options()) {
+    if (option == "-R") {
+      is_recursive = true;
+    }
+  }
+
+  int mode = -1;
+  if (parameters[0].size() == 1 && std::isdigit(static_cast<unsigned char>(parameters[0][0]))) {
+    mode = parameters[0][0] - '0';
+  }
+
+  if (mode < 0 || mode > 7) {
+    std::cout << arg.ProgramName() << ": invalid mode\n";
+    return;
+  }
+
+  auto cwd = shell.Cwd();
+  for (std::size_t i = 1; i < parameters.size(); i++) {
+    auto status = fs_->ChangeMode(JoinPath(cwd, parameters[i]), mode, is_recursive);
+    if (status == FileSystem::Status::kReadOnly) {
+      std::cout << arg.ProgramName() << ": read-only file system\n";
+    } else if (status == FileSystem::Status::kIoError) {
+      std::cout << arg.ProgramName() << ": input/output error\n";
+    } else if (status != FileSystem::Status::kOk) {
+      std::cout << arg.ProgramName() << ": target not found\n";
+    }
+  }
+}
+
+void DateCommand::Execute(Shell &shell) {
+  auto arg = shell.Arg();
+
+  if (!arg.HasParameters()) {
+    auto tp = std::chrono::system_clock::to_time_t(shell.DateTime());
+
+    auto format = arg.Format();
+    if (format == OutputFormat::kText) {
+      std::cout << std::ctime(&tp);
+      return;
+    }
+
+    char time[32];
+    std::strftime(time, sizeof(time), "%Y-%m-%dT%H:%M:%S", std::localtime(&tp));
+
+    RecordWriter writer{std::cout, format};
+    writer.BeginRecord();
+    writer.Field("time", time);
+    writer.Field("epoch", static_cast<std::int64_t>(tp));
+    writer.EndRecord();
+    return;
+  }
+
+  auto parameters = arg.Parameters();
+
+  if (parameters.size() < 2) {
+    std::cout << arg.ProgramName() << ": not enough parameter\n";
+    return;
+  }
+
+  auto format = parameters[0];
+  auto datetime = parameters[1];
+
+  std::stringstream datetime_stream{datetime};
+
+  std::tm tm{};
+  datetime_stream >> std::get_time(&tm, format.c_str());
+
+  if (datetime_stream.fail()) {
+    std::cout << arg.ProgramName() << ": failed to change date\n";
+    return;
+  }
+
+  auto tp = std::chrono::system_clock::from_time_t(std::mktime(&tm));
+  shell.SetDateTime(tp);
+}
+
+class MakeDirectoryCommand : public Command {
+public:
+  MakeDirectoryCommand(const std::shared_ptr<FileSystem> &);
+
+  virtual void Execute(Shell &);
+
+private:
+  std::shared_ptr<FileSystem> fs_;
+};
+
+MakeDirectoryCommand::MakeDirectoryCommand(const std::shared_ptr<FileSystem> &fs) : fs_{fs} {}
+
+class ClearCommand : public Command {
+public:
+  virtual void Execute(Shell &);
+};
+
+class LocateCommand : public Command {
+public:
+  LocateCommand(const std::shared_ptr<FileSystem> &);
+
+  virtual void Execute(Shell &);
+
+private:
+  std::shared_ptr<FileSystem> fs_;
+};
+
+LocateCommand::LocateCommand(const std::shared_ptr<FileSystem> &fs) : fs_{fs} {}
+
+void LocateCommand::Execute(Shell &shell) {
+  auto arg = shell.Arg();
+
+  if (!arg.HasParameters()) {
+    std::cout << arg.ProgramName() << ": missing operand\n";
+    return;
+  }
+
+  bool is_exact = false;
+  for (const auto &option : arg.Options()) {
+    if (option == "-x") {
+      is_exact = true;
+    }
+  }
+
+  auto format = arg.Format();
+  if (format != OutputFormat::kText) {
+    RecordWriter writer{std::cout, format};
+    for (const auto &parameter : arg.Parameters()) {
+      fs_->Locate(parameter, is_exact, [&](const std::string &path) {
+        writer.BeginRecord();
+        writer.Field("query", parameter);
+        writer.Field("path", path);
+        writer.EndRecord();
+      });
+    }
+    return;
+  }
+
+  for (const auto &parameter : arg.Parameters()) {
+    fs_->Locate(parameter, is_exact, [](const std::string &path) {
+      std::cout << path << '\n';
+    });
+  }
+}
+
+class DiskUsageCommand : public Command {
+public:
+  DiskUsageCommand(const std::shared_ptr<FileSystem> &);
+
+  virtual void Execute(Shell &);
+
+private:
+  std::shared_ptr<FileSystem> fs_;
+};
+
+DiskUsageCommand::DiskUsageCommand(const std::shared_ptr<FileSystem> &fs) : fs_{fs} {}
+
+void DiskUsageCommand::Execute(Shell &shell) {
+  auto arg = shell.Arg();
+
+  bool should_summarize = false;
+  for (const auto &option : arg.Options()) {
+    if (option == "-s") {
+      should_summarize = true;
+    }
+  }
+
+  auto parameters = arg.Parameters();
+  if (parameters.empty()) {
+    parameters.push_back(".");
+  }
+
+  auto print = [](const Usage &usage, const std::string &path) {
+    std::cout << usage.bytes << '\t' << usage.entries << " entries (" << usage.files << " files, "
+              << usage.directories << " directories)\t" << path << '\n';
+  };
+
+  auto cwd = shell.Cwd();
+  for (const auto &parameter : parameters) {
+    auto files = fs_->Resolve(JoinPath(cwd, parameter));
+    if (!files) {
+      std::cout << arg.ProgramName() << ": " << parameter << ": no such directory\n";
+      continue;
+    }
+
+    if (!should_summarize) {
+      for (const auto &entry : files->Entries()) {
+        if (entry.IsDirectory()) {
+          print(entry.Files()->Totals(), parameter + '/' + entry.Name());
+        }
+      }
+    }
+
+    print(files->Totals(), parameter);
+  }
+}
+
+class CheckCommand : public Command {
+public:
+  CheckCommand(const std::shared_ptr<FileSystem> &);
+
+  virtual void Execute(Shell &);
+
+private:
+  std::shared_ptr<FileSystem> fs_;
+};
+
+CheckCommand::CheckCommand(const std::shared_ptr<FileSystem> &fs) : fs_{fs} {}
+
+void CheckCommand::Execute(Shell &shell) {
+  auto problems = fs_->Check();
+  for (const auto &problem : problems) {
+    std::cout << shell.Arg().ProgramName() << ": " << problem << '\n';
+  }
+
+  if (problems.empty()) {
+    std::cout << shell.Arg().ProgramName() << ": clean\n";
+  }
+}
+
+class StatsCommand : public Command {
+public:
+  StatsCommand(const std::shared_ptr<FileSystem> &);
+
+  virtual void Execute(Shell &);
+
+private:
+  std::shared_ptr<FileSystem> fs_;
+};
+
+StatsCommand::StatsCommand(const std::shared_ptr<FileSystem> &fs) : fs_{fs} {}
+
+static void PrintCacheCounters(const PageCache &cache) {
+  const auto &counters = cache.GetCounters();
+  auto lookups = counters.hits + counters.misses;
+
+  std::cout << "page cache " << cache.Size() << " of " << cache.Capacity() << " pages, " << cache.DirtyPages()
+            << " dirty\n";
+  auto flags = std::cout.flags();
+  auto precision = std::cout.precision();
+  std::cout << "page cache hits " << counters.hits << ", misses " << counters.misses << " (" << std::fixed
+            << std::setprecision(1) << (lookups == 0 ? 0.0 : 100.0 * counters.hits / lookups)
+            << "% hit), read-ahead " << counters.read_ahead << ", evictions " << counters.evictions
+            << ", write-backs " << counters.write_backs << '\n';
+  std::cout.flags(flags);
+  std::cout.precision(precision);
+}
+
+// Interned names are never freed, so a name stays in the table after its
+// last entry is removed. Counts those and roughly what their strings hold.
+static void PrintInternedNames(const NameIndex &index) {
+  const auto &table = NameTable::Global();
+  auto size = table.Size();
+
+  std::size_t unused = 0;
+  std::size_t bytes = 0;
+  for (NameId name = 0; name < size; name++) {
+    if (!index.Contains(name)) {
+      unused++;
+      bytes += sizeof(std::string) + table.String(name).size();
+    }
+  }
+
+  std::cout << "interned names " << size << ", " << unused << " used by no entry, " << bytes / 1024 << " KB\n";
+}
+
+void StatsCommand::Execute(Shell &) {
+  const auto &index = fs_->Index();
+
+  std::cout << "nodes " << index.Size() << '\n';
+  PrintInternedNames(index);
+  std::cout << "name index " << index.Size() << " entries, " << index.TrigramCount() << " trigrams, "
+            << index.MemoryUsage() / 1024 << " KB\n";
+  PrintCacheCounters(fs_->Cache());
+}
+
+class SyncCommand : public Command {
+public:
+  SyncCommand(const std::shared_ptr<FileSystem> &);
+
+  virtual void Execute(Shell &);
+
+private:
+  std::shared_ptr<FileSystem> fs_;
+};
+
+SyncCommand::SyncCommand(const std::shared_ptr<FileSystem> &fs) : fs_{fs} {}
+
+void SyncCommand::Execute(Shell &shell) {
+  if (fs_->Sync() == FileSystem::Status::kIoError) {
+    std::cout << shell.Arg().ProgramName() << ": input/output error\n";
+  }
+}
+
+static void PrintFileError(const std::string &program_name, FileSystem::Status status) {
+  switch (status) {
+    case FileSystem::Status::kNotFound:
+      std::cout << program_name << ": no such file or directory\n";
+      break;
+    case FileSystem::Status::kIsDirectory:
+      std::cout << program_name << ": is a directory\n";
+      break;
+    case FileSystem::Status::kNoSpace:
+      std::cout << program_name << ": no space left on device\n";
+      break;
+    case FileSystem::Status::kReadOnly:
+      std::cout << program_name << ": read-only file system\n";
+      break;
+    case FileSystem::Status::kIoError:
+      std::cout << program_name << ": input/output error\n";
+      break;
+    default:
+      break;
+  }
+}
+
+class TouchCommand : public Command {
+public:
+  TouchCommand(const std::shared_ptr<FileSystem> &);
+
+  virtual void Execute(Shell &);
+
+private:
+  std::shared_ptr<FileSystem> fs_;
+};
+
+TouchCommand::TouchCommand(const std::shared_ptr<FileSystem> &fs) : fs_{fs} {}
+
+void TouchCommand::Execute(Shell &shell) {
+  auto arg = shell.Arg();
+
+  if (!arg.HasParameters()) {
+    std::cout << arg.ProgramName() << ": missing operand\n";
+    return;
+  }
+
+  auto cwd = shell.Cwd();
+  for (const auto &parameter : arg.Parameters()) {
+    auto status = fs_->CreateFile(JoinPath(cwd, parameter));
+    if (status != FileSystem::Status::kExists) {
+      PrintFileError(arg.ProgramName(), status);
+    }
+  }
+}
+
+class EchoCommand : public Command {
+public:
+  EchoCommand(const std::shared_ptr<FileSystem> &);
+
+  virtual void Execute(Shell &);
+
+private:
+  std::shared_ptr<FileSystem> fs_;
+};
+
+EchoCommand::EchoCommand(const std::shared_ptr<FileSystem> &fs) : fs_{fs} {}
+
+void EchoCommand::Execute(Shell &shell) {
+  auto arg = shell.Arg();
+  auto parameters = arg.Parameters();
+
+  std::string text;
+  std::string target;
+  bool should_append = false;
+  for (std::size_t i = 0; i < parameters.size(); i++) {
+    if (parameters[i].find('>') == 0) {
+      should_append = parameters[i].compare(0, 2, ">>") == 0;
+      target = parameters[i].substr(should_append ? 2 : 1);
+      if (target.empty() && i + 1 < parameters.size()) {
+        target = parameters[++i];
+      }
+      continue;
+    }
+
+    if (!text.empty()) {
+      text += ' ';
+    }
+    text += parameters[i];
+  }
+  text += '\n';
+
+  if (target.empty()) {
+    std::cout << text;
+    return;
+  }
+
+  PrintFileError(arg.ProgramName(), fs_->WriteFile(JoinPath(shell.Cwd(), target), text, should_append));
+}
+
+class CatCommand : public Command {
+public:
+  CatCommand(const std::shared_ptr<FileSystem> &);
+
+  virtual void Execute(Shell &);
+
+private:
+  std::shared_ptr<FileSystem> fs_;
+};
+
+CatCommand::CatCommand(const std::shared_ptr<FileSystem> &fs) : fs_{fs} {}
+
+void CatCommand::Execute(Shell &shell) {
+  auto arg = shell.Arg();
+
+  if (!arg.HasParameters()) {
+    std::cout << arg.ProgramName() << ": missing operand\n";
+    return;
+  }
+
+  auto cwd = shell.Cwd();
+  for (const auto &parameter : arg.Parameters()) {
+    auto status = fs_->ReadFile(JoinPath(cwd, parameter), [](const char *data, std::size_t length) {
+      std::cout.write(data, length);
+    });
+    PrintFileError(arg.ProgramName(), status);
+  }
+}
+
+class TruncateCommand : public Command {
+public:
+  TruncateCommand(const std::shared_ptr<FileSystem> &);
+
+  virtual void Execute(Shell &);
+
+private:
+  std::shared_ptr<FileSystem> fs_;
+};
+
+TruncateCommand::TruncateCommand(const std::shared_ptr<FileSystem> &fs) : fs_{fs} {}
+
+void TruncateCommand::Execute(Shell &shell) {
+  auto arg = shell.Arg();
+  auto parameters = arg.Parameters();
+
+  std::string size_text;
+  for (const auto &option : arg.Options()) {
+    if (option.compare(0, 2, "-s") == 0) {
+      size_text = option.substr(2);
+      if (size_text.empty() && !parameters.empty()) {
+        size_text = parameters.front();
+        parameters.erase(parameters.begin());
+      }
+    }
+  }
+
+  if (size_text.empty() || parameters.empty()) {
+    std::cout << arg.ProgramName() << ": usage: truncate -s SIZE[K|M|G|T] file...\n";
+    return;
+  }
+
+  std::uint64_t size = 0;
+  std::size_t i = 0;
+  for (; i < size_text.size() && std::isdigit(static_cast<unsigned char>(size_text[i])); i++) {
+    size = size * 10 + (size_text[i] - '0');
+  }
+
+  const std::string units{"KMGT"};
+  auto unit = i + 1 == size_text.size() ? units.find(size_text[i]) : std::string::npos;
+  if (i == 0 || (i < size_text.size() && unit == std::string::npos)) {
+    std::cout << arg.ProgramName() << ": invalid size\n";
+    return;
+  }
+  if (unit != std::string::npos) {
+    size <<= 10 * (unit + 1);
+  }
+
+  auto cwd = shell.Cwd();
+  for (const auto &parameter : parameters) {
+    PrintFileError(arg.ProgramName(), fs_->Truncate(JoinPath(cwd, parameter), size));
+  }
+}
+
+class DiskFreeCommand : public Command {
+public:
+  DiskFreeCommand(const std::shared_ptr<FileSystem> &);
+
+  virtual void Execute(Shell &);
+
+private:
+  std::shared_ptr<FileSystem> fs_;
+};
+
+DiskFreeCommand::DiskFreeCommand(const std::shared_ptr<FileSystem> &fs) : fs_{fs} {}
+
+void DiskFreeCommand::Execute(Shell &) {
+  const auto &device = fs_->Device();
+
+  auto kilobytes_per_block = BlockDevice::kBlockSize / 1024;
+  auto total = device.BlockCount() * kilobytes_per_block;
+  auto available = device.FreeBlocks() * kilobytes_per_block;
+  auto used = total - available;
+  auto percent = total == 0 ? 0 : (used * 100 + total - 1) / total;
+
+  std::cout << std::left << std::setw(12) << "Filesystem" << std::right << std::setw(14) << "1K-blocks"
+            << std::setw(14) << "Used" << std::setw(14) << "Available" << std::setw(6) << "Use%"
+            << " Mounted on\n";
+  std::cout << std::left << std::setw(12) << "/dev/sda" << std::right << std::setw(14) << total
+            << std::setw(14) << used << std::setw(14) << available << std::setw(5) << percent << "%"
+            << " /\n";
+  std::cout << "free extents " << device.FreeExtents() << ", largest " << device.LargestFreeExtent()
+            << " blocks\n";
+}
+
+class MountCommand : public Command {
+public:
+  MountCommand(const std::shared_ptr<FileSystem> &);
+
+  virtual void Execute(Shell &);
+
+private:
+  std::shared_ptr<FileSystem> fs_;
+};
+
+MountCommand::MountCommand(const std::shared_ptr<FileSystem> &fs) : fs_{fs} {}
+
+void MountCommand::Execute(Shell &shell) {
+  auto arg = shell.Arg();
+  auto parameters = arg.Parameters();
+
+  if (parameters.empty()) {
+    for (const auto &[host_path, path] : fs_->Mounts()) {
+      std::cout << host_path << " on " << path << " type host (ro)\n";
+    }
+    return;
+  }
+
+  if (parameters.size() < 2) {
+    std::cout << arg.ProgramName() << ": not enough parameter\n";
+    return;
+  }
+
+  switch (fs_->Mount(parameters[0], JoinPath(shell.Cwd(), parameters[1]))) {
+    case FileSystem::Status::kNotFound:
+      std::cout << arg.ProgramName() << ": no such file or directory\n";
+      break;
+    case FileSystem::Status::kExists:
+      std::cout << arg.ProgramName() << ": mount point is not empty\n";
+      break;
+    case FileSystem::Status::kBusy:
+      std::cout << arg.ProgramName() << ": mount point is busy\n";
+      break;
+    case FileSystem::Status::kUnsupported:
+      std::cout << arg.ProgramName() << ": host mounts are not supported on this system\n";
+      break;
+    default:
+      break;
+  }
+}
+
+class UnmountCommand : public Command {
+public:
+  UnmountCommand(const std::shared_ptr<FileSystem> &);
+
+  virtual void Execute(Shell &);
+
+private:
+  std::shared_ptr<FileSystem> fs_;
+};
+
+UnmountCommand::UnmountCommand(const std::shared_ptr<FileSystem> &fs) : fs_{fs} {}
+
+void UnmountCommand::Execute(Shell &shell) {
+  auto arg = shell.Arg();
+
+  if (!arg.HasParameters()) {
+    std::cout << arg.ProgramName() << ": missing operand\n";
+    return;
+  }
+
+  auto cwd = shell.Cwd();
+  for (const auto &parameter : arg.Parameters()) {
+    auto path = JoinPath(cwd, parameter);
+
+    if (path.size() <= cwd.size() && std::equal(path.begin(), path.end(), cwd.begin())) {
+      std::cout << arg.ProgramName() << ": target is busy\n";
+      continue;
+    }
+
+    if (fs_->Unmount(path) != FileSystem::Status::kOk) {
+      std::cout << arg.ProgramName() << ": " << parameter << ": not mounted\n";
+    }
+  }
+}
+
+void ShutdownCommand::Execute(Shell &shell) {
+  shell.Shutdown();
+}
+
+void ListCommand::Execute(Shell &shell) {
+  auto arg = shell.Arg();
+
+  bool should_detail = false;
+  if (arg.HasOptions()) {
+    auto options = arg.Options();
+
+    for (const auto &option : options) {
+      if (option == "-l") {
+        should_detail = true;
+      }
+    }
+  }
+
+  auto format = arg.Format();
+  if (format != OutputFormat::kText) {
+    fs_->TraverseDirectory(shell.Cwd(), [&](std::shared_ptr<Directory> files) {
+      RecordWriter writer{std::cout, format};
+      for (const auto &f : files->Entries()) {
+        char mode[] = {f.Readable() ? 'r' : '-', f.Writeable() ? 'w' : '-', f.Executable() ? 'x' : '-'};
+
+        writer.BeginRecord();
+        writer.Field("name", f.Name());
+        writer.Field("type", f.IsDirectory() ? "directory" : "file");
+        writer.Field("mode", std::string_view{mode, sizeof(mode)});
+        writer.Field("size", f.IsDirectory() ? f.Files()->Totals().bytes : f.Size());
+        writer.EndRecord();
+      }
+    });
+    return;
+  }
+
+  fs_->TraverseDirectory(shell.Cwd(), [&](std::shared_ptr<Directory> files) {
+    if (should_detail) {
+      // The total counts every entry below the directory, read from its
+      // maintained aggregate rather than a walk.
+      std::cout << "total " << files->Totals().entries << '\n';
+      for (const auto &f : files->Entries()) {
+        if (f.IsDirectory()) {
+          std::cout << 'd';
+        } else {
+          std::cout << '-';
+        }
+
+        if (f.Readable()) {
+          std::cout << 'r';
+        } else {
+          std::cout << '-';
+        }
+
+        if (f.Writeable()) {
+          std::cout << 'w';
+        } else {
+          std::cout << '-';
+        }
+
+        if (f.Executable()) {
+          std::cout << 'x';
+        } else {
+          std::cout << '-';
+        }
+
+        std::cout << " " << f.Name() << '\n';
+      }     
+    } else {
+      for (const auto &f : files->Entries()) {
+        std::cout << f.Name() << ' ';
+      }
+    }
+
+    if (!should_detail) {
+      std::cout << '\n';
+    }
+  });
+}
+
+void RemoveCommand::Execute(Shell &shell) {
+  auto arg = shell.Arg();
+
+  if (!arg.HasParameters()) {
+    std::cout << arg.ProgramName() << ": missing operand\n";
+    return;
+  }
+
+  bool is_recursive = false;
+  for (const auto &option : arg.Options()) {
+    if (option == "-r" || option == "-R" || option == "-rf") {
+      is_recursive = true;
+    }
+  }
+
+  auto cwd = shell.Cwd();
+  for (const auto &parameter : arg.Parameters()) {
+    auto path = JoinPath(cwd, parameter);
+
+    if (path.size() <= cwd.size() && std::equal(path.begin(), path.end(), cwd.begin())) {
+      std::cout << arg.ProgramName() << ": cannot remove current directory\n";
+      continue;
+    }
+
+    switch (fs_->Remove(path, is_recursive)) {
+      case FileSystem::Status::kNotFound:
+        std::cout << arg.ProgramName() << ": no such file or directory\n";
+        break;
+      case FileSystem::Status::kIsDirectory:
+        std::cout << arg.ProgramName() << ": is a directory\n";
+        break;
+      case FileSystem::Status::kReadOnly:
+        std::cout << arg.ProgramName() << ": read-only file system\n";
+        break;
+      case FileSystem::Status::kBusy:
+        std::cout << arg.ProgramName() << ": device or resource busy\n";
+        break;
+      case FileSystem::Status::kIoError:
+        std::cout << arg.ProgramName() << ": input/output error\n";
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+void MakeDirectoryCommand::Execute(Shell &shell) {
+  auto arg = shell.Arg();
+
+  if (!arg.HasParameters()) {
+    std::cout << arg.ProgramName() << ": missing operand\n";
+    return;
+  }
+
+  bool should_create_parents = false;
+  for (const auto &option : arg.Options()) {
+    if (option == "-p") {
+      should_create_parents = true;
+    }
+  }
+
+  auto cwd = shell.Cwd();
+  for (const auto &parameter : arg.Parameters()) {
+    switch (fs_->MakeDirectory(JoinPath(cwd, parameter), should_create_parents)) {
+      case FileSystem::Status::kExists:
+        if (!should_create_parents) {
+          std::cout << arg.ProgramName() << ": file exists\n";
+        }
+        break;
+      case FileSystem::Status::kNotDirectory:
+        std::cout << arg.ProgramName() << ": not a directory\n";
+        break;
+      case FileSystem::Status::kNotFound:
+        std::cout << arg.ProgramName() << ": no such file or directory\n";
+        break;
+      case FileSystem::Status::kReadOnly:
+        std::cout << arg.ProgramName() << ": read-only file system\n";
+        break;
+      case FileSystem::Status::kIoError:
+        std::cout << arg.ProgramName() << ": input/output error\n";
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+void ClearCommand::Execute(Shell &shell) {
+  if (!shell.HasTerminal()) {
+    return;
+  }
+
+#if defined(_WIN32)
+  std::system("cls");
+#else
+  std::system("clear");
+#endif
+}
+
+void Shell::MainLoop() {
+  while (!IsAuthenticating()) {
+    if (!std::cin) {
+      return;
+    }
+  }
+
+  if (const char *home = std::getenv("HOME")) {
+    line_editor_.LoadHistory(std::string{home} + "/.proses_history");
+  }
+
+  if (!record_path_.empty()) {
+    recorder_ = SessionRecorder::Create(record_path_, current_user_.Login(), computer_.TimePoint(), fs_->Snapshot());
+    if (!recorder_) {
+      std::cout << "record: cannot open " << record_path_ << '\n';
+    }
+  }
+
+  std::string input;
+
+  while (IsRunning()) {
+    if (!line_editor_.ReadLine(Prompt(), input)) {
+      Shutdown();
+      break;
+    }
+    
+    if (recorder_) {
+      recorder_->Capture(*this, input);
+    } else {
+      Execute(input);
+    }
+  }
+
+  recorder_.reset();
+
+  fs_->Checkpoint();
+}
+
+void Shell::Shutdown() {
+  is_running_ = false;
+}
+
+// Commands that act on the terminal itself rather than print to std::cout
+// leave it alone from then on, for sessions replayed into a buffer.
+void Shell::DetachTerminal() {
+  has_terminal_ = false;
+}
+
+bool Shell::HasTerminal() const {
+  return has_terminal_;
+}
+
+// A zero capacity or memory budget is taken from the machine's storages
+// and RAM modules.
+static std::shared_ptr<FileSystem> MakeFileSystem(const Computer &computer, std::uint64_t capacity,
+                                                  std::uint64_t memory) {
+  if (capacity == 0) {
+    for (const auto &storage : computer.GetMotherboard().StorageList()) {
+      capacity += std::uint64_t{storage.capacity} << 30;
+    }
+  }
+
+  if (memory == 0) {
+    for (const auto &ram : computer.GetMotherboard().RAMList()) {
+      memory += std::uint64_t{ram.capacity} << 30;
+    }
+  }
+
+  return std::make_shared<FileSystem>(capacity, memory);
+}
+
+std::shared_ptr<FileSystem> Shell::OpenFileSystem(const Computer &computer) {
+  auto fs = MakeFileSystem(computer, 0, 0);
+  if (const char *home = std::getenv("HOME")) {
+    auto image = std::string{home} + "/.proses_image";
+    if (!fs->Open(image, std::string{home} + "/.proses_journal")) {
+      std::cout << "fs: " << image << " is damaged and was left as it is; changes in this session will not be saved\n";
+    }
+  } else {
+    fs->for_dev_populate();
+  }
+
+  return fs;
+}
+
+Shell::Shell(const Computer &computer) : Shell{computer, OpenFileSystem(computer)} {}
+
+Shell::Shell(const Computer &computer, const std::shared_ptr<FileSystem> &fs)
+  : is_running_{true}, cwd_{"/"}, fs_{fs}, computer_{computer} {
+
+  users_ = {
+    User::CreateSuperuser("root", "12345678"),
+    User::Create("user", "12345678")
+  };
+
+  commands_.insert({"shutdown", std::make_unique<ShutdownCommand>()});
+  commands_.insert({"ls", std::make_unique<ListCommand>(fs)});
+  commands_.insert({"mkdir", std::make_unique<MakeDirectoryCommand>(fs)});
+  commands_.insert({"clear", std::make_unique<ClearCommand>()});
+  commands_.insert({"rm", std::make_unique<RemoveCommand>(fs)});
+  commands_.insert({"chmod", std::make_unique<ChangeModeCommand>(fs)});
+  commands_.insert({"date", std::make_unique<DateCommand>()});
+  commands_.insert({"cd", std::make_unique<ChangeDirectoryCommand>(fs)});
+  commands_.insert({"locate", std::make_unique<LocateCommand>(fs)});
+  commands_.insert({"stats", std::make_unique<StatsCommand>(fs)});
+  commands_.insert({"du", std::make_unique<DiskUsageCommand>(fs)});
+  commands_.insert({"fsck", std::make_unique<CheckCommand>(fs)});
+  commands_.insert({"touch", std::make_unique<TouchCommand>(fs)});
+  commands_.insert({"echo", std::make_unique<EchoCommand>(fs)});
+  commands_.insert({"cat", std::make_unique<CatCommand>(fs)});
+  commands_.insert({"truncate", std::make_unique<TruncateCommand>(fs)});
+  commands_.insert({"df", std::make_unique<DiskFreeCommand>(fs)});
+  commands_.insert({"sync", std::make_unique<SyncCommand>(fs)});
+  commands_.insert({"mount", std::make_unique<MountCommand>(fs)});
+  commands_.insert({"umount", std::make_unique<UnmountCommand>(fs)});
+
+  for (const auto &command : commands_) {
+    command_index_.Insert(NameTable::Global().Intern(command.first));
+  }
+
+  line_editor_.SetCompleter([this](const std::string &word, bool is_command) {
+    return Complete(word, is_command);
+  });
+}
+
+void Shell::Execute(const std::string &input) {
+  ParseArgs(Tokenize(input));
+}
+
+void Shell::Record(const std::string &path) {
+  record_path_ = path;
+}
+
+void SessionRecorder::Capture(Shell &shell, const std::string &line) {
+  using Clock = std::chrono::steady_clock;
+
+  CaptureBuffer capture{std::cout.rdbuf()};
+  auto *original = std::cout.rdbuf(&capture);
+
+  auto before = Clock::now();
+  shell.Execute(line);
+  auto after = Clock::now();
+
+  std::cout.rdbuf(original);
+
+  std::string record;
+  PutVarint(record, std::chrono::duration_cast<std::chrono::microseconds>(before - started_).count());
+  PutString(record, line);
+  PutString(record, capture.Captured());
+  PutVarint(record, std::chrono::duration_cast<std::chrono::nanoseconds>(after - before).count());
+
+  // Every command is flushed on its own so a crashed session still
+  // replays up to the command that brought it down.
+  std::fwrite(record.data(), 1, record.size(), file_);
+  std::fflush(file_);
+}
+
+bool Shell::IsRunning() const {
+  return is_running_;
+}
+
+Argument Shell::Arg() const {
+  return arg_;
+}
+
+static inline void rtrim(std::string &s) {
+  s.erase(std::find_if(s.rbegin(), s.rend(), [](unsigned char ch) {
+    return !std::isspace(ch);
+  }).base(), s.end());
+}
+
+std::vector<std::string> Shell::Tokenize(std::string s) {
   std::vector<std::string> args;
 
-  rtrim(s);
+  rtrim(s);
+
+  std::size_t pos = 0;
+  while ((pos = s.find(' ')) != std::string::npos) {
+      args.push_back(s.substr(0, pos));
+      s.erase(0, pos + 1);
+  }
+  args.push_back(s);
+
+  return args;
+}
+
+void Shell::ParseArgs(const std::vector<std::string> &args) {
+  if (args.size() < 1) {
+    return;
+  }
+
+  Argument argument{};
+  argument.SetProgramName(args[0]);
+
+  std::vector<std::string> parameters{};
+  std::vector<std::string> options{};
+  if (args.size() > 1) {
+    for (std::size_t i = 1; i < args.size(); i++) {
+      if (args[i].find('-') == 0) {
+        options.push_back(args[i]);
+      } else {
+        parameters.push_back(args[i]);
+      }
+    }
+  }
+
+  argument.SetParameters(parameters);
+  argument.SetOptions(options);
+
+  arg_ = argument;
+
+  auto cmd = arg_.ProgramName();
+  if (ContainsCommand(cmd)) {
+    commands_[cmd]->Execute(*this);
+    return;
+  }
+
+  std::cout << "command not found: " << cmd << '\n';
+}
+
+bool Shell::ContainsCommand(const std::string &cmd) {
+  return commands_.find(cmd) != commands_.end();
+}
+
+class Workload {
+public:
+  struct Options {
+    std::uint64_t seed{1};
+    std::size_t depth{4};
+    std::size_t fanout{8};
+    double file_ratio{0.5};
+    std::size_t name_min{3};
+    std::size_t name_max{12};
+    std::size_t vocabulary{0};
+    std::size_t operations{100000};
+    std::uint64_t capacity{0};
+    std::uint64_t memory{0};
+    std::map<std::string, std::size_t> mix{{"cd", 30}, {"ls", 30}, {"mkdir", 15}, {"rm", 10}, {"chmod", 15}};
+  };
+
+  static bool ParseOptions(int, char **, Options &);
+
+  explicit Workload(const Options &);
+
+  std::shared_ptr<Directory> GenerateTree();
+  void Run(Shell &, const std::shared_ptr<FileSystem> &);
+
+private:
+  std::size_t Uniform(std::size_t);
+  std::string FreshName();
+  std::string RandomName();
+  std::string NextCommand(Shell &, const std::shared_ptr<FileSystem> &);
+
+private:
+  Options options_;
+  std::mt19937_64 random_;
+
+  std::vector<std::string> vocabulary_;
+  std::size_t node_count_{0};
+};
+
+static std::size_t PeakResidentKilobytes() {
+#if defined(_WIN32)
+  return 0;
+#else
+  rusage usage{};
+  getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+  return usage.ru_maxrss / 1024;
+#else
+  return usage.ru_maxrss;
+#endif
+#endif
+}
+
+bool Workload::ParseOptions(int argc, char **argv, Options &options) {
+  for (int i = 2; i < argc; i++) {
+    std::string option{argv[i]};
+    auto separator = option.find('=');
+    if (option.compare(0, 2, "--") != 0 || separator == std::string::npos) {
+      std::cout << "load: invalid option " << option << '\n';
+      return false;
+    }
+
+    auto key = option.substr(2, separator - 2);
+    auto value = option.substr(separator + 1);
+
+    try {
+      if (key == "seed") {
+        options.seed = std::stoull(value);
+      } else if (key == "depth") {
+        options.depth = std::stoul(value);
+      } else if (key == "fanout") {
+        options.fanout = std::stoul(value);
+      } else if (key == "file-ratio") {
+        options.file_ratio = std::stod(value);
+      } else if (key == "name-min") {
+        options.name_min = std::max<std::size_t>(1, std::stoul(value));
+      } else if (key == "name-max") {
+        options.name_max = std::stoul(value);
+      } else if (key == "vocabulary") {
+        options.vocabulary = std::stoul(value);
+      } else if (key == "ops") {
+        options.operations = std::stoul(value);
+      } else if (key == "capacity") {
+        options.capacity = std::stoull(value) << 20;
+      } else if (key == "memory") {
+        options.memory = std::stoull(value) << 20;
+      } else if (key == "mix") {
+        // --mix=cd:30,ls:30,mkdir:15,rm:10,chmod:15
+        options.mix.clear();
+        std::stringstream mix_stream{value};
+        std::string item;
+        while (std::getline(mix_stream, item, ',')) {
+          auto colon = item.find(':');
+          if (colon == std::string::npos) {
+            throw std::invalid_argument{item};
+          }
+          options.mix[item.substr(0, colon)] = std::stoul(item.substr(colon + 1));
+        }
+      } else {
+        std::cout << "load: unknown option " << key << '\n';
+        return false;
+      }
+    } catch (const std::exception &) {
+      std::cout << "load: invalid value for " << key << '\n';
+      return false;
+    }
+  }
+
+  options.name_max = std::max(options.name_max, options.name_min);
+  return true;
+}
+
+Workload::Workload(const Options &options) : options_{options}, random_{options.seed} {
+  // The pool is drawn with FreshName, never RandomName, which would pick
+  // from the pool being built. Repeats are skipped so --vocabulary is the
+  // number of distinct names, as far as the name lengths allow.
+  std::set<std::string> seen;
+  for (std::size_t attempt = 0; vocabulary_.size() < options_.vocabulary && attempt < 16 * options_.vocabulary;
+       attempt++) {
+    auto name = FreshName();
+    if (seen.insert(name).second) {
+      vocabulary_.push_back(std::move(name));
+    }
+  }
+}
+
+std::size_t Workload::Uniform(std::size_t bound) {
+  // Plain modulo keeps sequences identical across standard libraries,
+  // which the distribution classes do not guarantee.
+  return bound == 0 ? 0 : random_() % bound;
+}
+
+std::string Workload::RandomName() {
+  if (!vocabulary_.empty()) {
+    return vocabulary_[Uniform(vocabulary_.size())];
+  }
+
+  return FreshName();
+}
+
+std::string Workload::FreshName() {
+  auto length = options_.name_min + Uniform(options_.name_max - options_.name_min + 1);
+  std::string name(length, 'a');
+  for (auto &c : name) {
+    c = static_cast<char>('a' + Uniform(26));
+  }
+
+  return name;
+}
+
+std::shared_ptr<Directory> Workload::GenerateTree() {
+  auto root = std::make_shared<Directory>();
+
+  std::vector<std::pair<std::shared_ptr<Directory>, std::size_t>> pending{{root, 0}};
+  while (!pending.empty()) {
+    auto [directory, level] = pending.back();
+    pending.pop_back();
+
+    auto children = Uniform(2 * options_.fanout + 1);
+    std::vector<std::string> names;
+    for (std::size_t i = 0; i < children; i++) {
+      bool is_file = level + 1 >= options_.depth || Uniform(1000) < options_.file_ratio * 1000;
+
+      // Siblings need distinct names. A small --vocabulary runs out in wide
+      // directories, so repeated collisions fall back to fresh names.
+      auto name = RandomName();
+      for (std::size_t attempt = 1; attempt < 64 && std::find(names.begin(), names.end(), name) != names.end();
+           attempt++) {
+        name = attempt < 16 ? RandomName() : FreshName();
+      }
+      if (std::find(names.begin(), names.end(), name) != names.end()) {
+        continue;
+      }
+      names.push_back(name);
+
+      auto entry = is_file ? FileOrDirectory::CreateFile(name) : FileOrDirectory::CreateDirectory(name);
+      entry.SetPermission(static_cast<unsigned char>(Uniform(8)));
+
+      if (!is_file) {
+        pending.push_back({entry.Files(), level + 1});
+      }
+
+      directory->Add(entry);
+      node_count_++;
+    }
+  }
+
+  return root;
+}
+
+std::string Workload::NextCommand(Shell &shell, const std::shared_ptr<FileSystem> &fs) {
+  std::size_t total = 0;
+  for (const auto &[name, weight] : options_.mix) {
+    total += weight;
+  }
+
+  auto pick = Uniform(total);
+  std::string operation = "ls";
+  for (const auto &[name, weight] : options_.mix) {
+    if (pick < weight) {
+      operation = name;
+      break;
+    }
+    pick -= weight;
+  }
+
+  auto cwd = shell.Cwd();
+  auto files = fs->Resolve(cwd);
+  const auto &entries = files->Entries();
+
+  if (operation == "cd") {
+    std::vector<std::size_t> directories;
+    for (std::size_t i = 0; i < entries.size(); i++) {
+      if (entries[i].IsDirectory()) {
+        directories.push_back(i);
+      }
+    }
+
+    bool should_go_up = cwd.size() > 1 && (directories.empty() || cwd.size() > options_.depth || Uniform(4) == 0);
+    if (should_go_up || directories.empty()) {
+      return "cd ..";
+    }
+    return "cd " + entries[directories[Uniform(directories.size())]].Name();
+  }
+
+  if (operation == "mkdir") {
+    return "mkdir " + RandomName();
+  }
+
+  if (operation == "rm" && !entries.empty()) {
+    const auto &entry = entries[Uniform(entries.size())];
+    return entry.IsDirectory() ? "rm -r " + entry.Name() : "rm " + entry.Name();
+  }
+
+  if (operation == "chmod" && !entries.empty()) {
+    return "chmod " + std::to_string(Uniform(8)) + ' ' + entries[Uniform(entries.size())].Name();
+  }
+
+  if (operation == "ls") {
+    return Uniform(2) == 0 ? "ls" : "ls -l";
+  }
+
+  if (operation == "echo") {
+    return "echo " + RandomName() + (Uniform(2) == 0 ? " > " : " >> ") + RandomName();
+  }
+
+  if (operation == "truncate") {
+    // Sizes spread over four orders of magnitude so freed extents of every
+    // order are mixed together, which is what fragments an allocator.
+    auto size = std::uint64_t{1} << (10 + Uniform(14));
+    return "truncate -s " + std::to_string(size + Uniform(size)) + ' ' + RandomName();
+  }
+
+  if (operation == "cat") {
+    for (std::size_t attempt = 0; attempt < 4 && !entries.empty(); attempt++) {
+      const auto &entry = entries[Uniform(entries.size())];
+      if (!entry.IsDirectory()) {
+        return "cat " + entry.Name();
+      }
+    }
+    return "ls";
+  }
+
+  if (operation == "du") {
+    return "du -s";
+  }
+
+  if (operation == "locate") {
+    auto name = RandomName();
+    return Uniform(2) == 0 ? "locate -x " + name : "locate " + name.substr(0, 3 + Uniform(name.size() - 2));
+  }
+
+  return operation;
+}
+
+void Workload::Run(Shell &shell, const std::shared_ptr<FileSystem> &fs) {
+  using Clock = std::chrono::steady_clock;
+
+  std::map<std::string, std::vector<std::uint64_t>> latencies;
+  std::vector<std::uint64_t> all;
+  all.reserve(options_.operations);
+
+  std::ostringstream sink;
+  auto *original = std::cout.rdbuf(sink.rdbuf());
+
+  auto started = Clock::now();
+  for (std::size_t i = 0; i < options_.operations; i++) {
+    auto command = NextCommand(shell, fs);
+
+    auto before = Clock::now();
+    shell.Execute(command);
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - before).count();
+
+    all.push_back(elapsed);
+    latencies[command.substr(0, command.find(' '))].push_back(elapsed);
+
+    if (sink.tellp() > (1 << 20)) {
+      sink.str({});
+    }
+  }
+  auto wall = std::chrono::duration<double>(Clock::now() - started).count();
+
+  std::cout.rdbuf(original);
+
+  auto percentile = [](std::vector<std::uint64_t> &samples, double p) -> double {
+    if (samples.empty()) {
+      return 0;
+    }
+    auto index = static_cast<std::size_t>(p * (samples.size() - 1));
+    return samples[index] / 1000.0;
+  };
+
+  double busy = 0;
+  for (auto sample : all) {
+    busy += sample / 1e9;
+  }
+  std::sort(all.begin(), all.end());
+
+  std::cout << std::fixed << std::setprecision(2);
+  std::cout << "seed " << options_.seed << ", " << node_count_ << " generated nodes, " << options_.operations << " ops";
+  if (!vocabulary_.empty()) {
+    std::cout << ", vocabulary of " << vocabulary_.size() << " names";
+  }
+  std::cout << '\n';
+  std::cout << "throughput " << (busy > 0 ? options_.operations / busy : 0) << " ops/s (wall " << wall << " s)\n";
+  std::cout << "latency us p50 " << percentile(all, 0.5) << " p90 " << percentile(all, 0.9)
+            << " p99 " << percentile(all, 0.99) << " p99.9 " << percentile(all, 0.999)
+            << " max " << percentile(all, 1.0) << '\n';
+
+  for (auto &[command, samples] : latencies) {
+    std::sort(samples.begin(), samples.end());
+    std::cout << "  " << std::left << std::setw(6) << command << std::right << std::setw(9) << samples.size()
+              << " ops  p50 " << percentile(samples, 0.5) << " p99 " << percentile(samples, 0.99) << " us\n";
+  }
+
+  std::cout << "name index " << fs->Index().MemoryUsage() / 1024 << " KB for " << fs->Index().Size() << " entries\n";
+  PrintInternedNames(fs->Index());
+  const auto &device = fs->Device();
+  std::cout << "device " << device.BlockCount() - device.FreeBlocks() << " of " << device.BlockCount()
+            << " blocks used, " << device.FreeExtents() << " free extents, largest " << device.LargestFreeExtent()
+            << " blocks\n";
+  PrintCacheCounters(fs->Cache());
+  std::cout << "consistency " << (fs->Check().empty() ? "clean" : "BROKEN") << '\n';
+  std::cout << "peak rss " << PeakResidentKilobytes() << " KB\n";
+}
+
+static int RunLoad(int argc, char **argv) {
+  Workload::Options options;
+  if (!Workload::ParseOptions(argc, argv, options)) {
+    return 1;
+  }
+
+  Workload workload{options};
+
+  auto computer = Computer::Assemble();
+  auto fs = MakeFileSystem(computer, options.capacity, options.memory);
+  fs->SetRoot(workload.GenerateTree());
 
-  std::size_t pos = 0;
-  while ((pos = s.find(' ')) != std::string::npos) {
-      args.push_back(s.substr(0, pos));
-      s.erase(0, pos + 1);
+  Shell shell{computer, fs};
+  workload.Run(shell, fs);
+
+  return 0;
+}
+
+// Discards everything written to it and only keeps the byte count.
+class CountingBuffer : public std::streambuf {
+public:
+  std::uint64_t Count() const;
+
+protected:
+  int_type overflow(int_type) override;
+  std::streamsize xsputn(const char *, std::streamsize) override;
+
+private:
+  std::uint64_t count_{0};
+};
+
+std::uint64_t CountingBuffer::Count() const {
+  return count_;
+}
+
+CountingBuffer::int_type CountingBuffer::overflow(int_type c) {
+  if (!traits_type::eq_int_type(c, traits_type::eof())) {
+    count_++;
   }
-  args.push_back(s);
+  return traits_type::not_eof(c);
+}
 
-  return args;
+std::streamsize CountingBuffer::xsputn(const char *, std::streamsize n) {
+  count_ += n;
+  return n;
 }
 
-void Shell::ParseArgs(const std::vector<std::string> &args) {
-  if (args.size() < 1) {
-    return;
+// Lists one wide directory with every output format and reports the
+// per-entry formatting cost, best of several rounds.
+static int RunFormatBench(int argc, char **argv) {
+  std::size_t entries = 100000;
+  std::size_t rounds = 5;
+  for (int i = 2; i < argc; i++) {
+    std::string option{argv[i]};
+    try {
+      if (option.compare(0, 10, "--entries=") == 0) {
+        entries = std::max<std::size_t>(1, std::stoul(option.substr(10)));
+      } else if (option.compare(0, 9, "--rounds=") == 0) {
+        rounds = std::max<std::size_t>(1, std::stoul(option.substr(9)));
+      } else {
+        std::cout << "bench-format: unknown option " << option << '\n';
+        return 1;
+      }
+    } catch (const std::exception &) {
+      std::cout << "bench-format: invalid option " << option << '\n';
+      return 1;
+    }
   }
 
-  Argument argument{};
-  argument.SetProgramName(args[0]);
+  auto computer = Computer::Assemble();
+  auto root = std::make_shared<Directory>();
+  for (std::size_t i = 0; i < entries; i++) {
+    auto name = "entry_" + std::to_string(i);
+    root->Add(i % 4 == 0 ? FileOrDirectory::CreateDirectory(name) : FileOrDirectory::CreateFile(name));
+  }
 
-  std::vector<std::string> parameters{};
-  std::vector<std::string> options{};
-  if (args.size() > 1) {
-    for (std::size_t i = 1; i < args.size(); i++) {
-      if (args[i].find('-') == 0) {
-        options.push_back(args[i]);
+  auto fs = MakeFileSystem(computer, 0, 0);
+  fs->SetRoot(root);
+
+  Shell shell{computer, fs};
+
+  std::cout << entries << " entries, best of " << rounds << " rounds\n";
+  std::cout << std::fixed << std::setprecision(1);
+  for (const char *command : {"ls", "ls -l", "ls --json", "ls --ndjson"}) {
+    double best = 0;
+    std::uint64_t bytes = 0;
+    for (std::size_t round = 0; round < rounds; round++) {
+      CountingBuffer sink;
+      auto *original = std::cout.rdbuf(&sink);
+
+      auto before = std::chrono::steady_clock::now();
+      shell.Execute(command);
+      auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - before).count();
+
+      std::cout.rdbuf(original);
+
+      if (round == 0 || elapsed < best) {
+        best = elapsed;
+      }
+      bytes = sink.Count();
+    }
+
+    std::cout << "  " << std::left << std::setw(12) << command << std::right << std::setw(8) << best / entries
+              << " ns/entry " << std::setw(6) << static_cast<double>(bytes) / entries << " bytes/entry\n";
+  }
+
+  return 0;
+}
+
+static constexpr std::size_t kDivergenceLimit = 20;
+static constexpr std::size_t kSlowestLimit = 5;
+
+// Commands whose output depends on the clock or on process-wide counters,
+// so a replay is not expected to reproduce it.
+static bool IsLiveOutput(const std::string &line) {
+  auto command = line.substr(0, line.find(' '));
+  return command == "date" || command == "stats";
+}
+
+static void PrintDivergence(std::size_t index, const SessionRecorder::Entry &entry, const std::string &actual) {
+  auto split = [](const std::string &text) {
+    std::vector<std::string> lines;
+    std::stringstream stream{text};
+    for (std::string line; std::getline(stream, line);) {
+      lines.push_back(line);
+    }
+    return lines;
+  };
+
+  auto expected_lines = split(entry.output);
+  auto actual_lines = split(actual);
+
+  std::size_t line = 0;
+  while (line < expected_lines.size() && line < actual_lines.size() && expected_lines[line] == actual_lines[line]) {
+    line++;
+  }
+
+  auto quote = [](const std::vector<std::string> &lines, std::size_t i) {
+    return i < lines.size() ? '"' + lines[i] + '"' : std::string{"<end of output>"};
+  };
+
+  std::cout << "  #" << index + 1 << ' ' << entry.line << '\n';
+  std::cout << "    line " << line + 1 << ": expected " << quote(expected_lines, line) << '\n';
+  std::cout << "    line " << line + 1 << ": actual   " << quote(actual_lines, line) << '\n';
+}
+
+static int RunReplay(int argc, char **argv) {
+  using Clock = std::chrono::steady_clock;
+
+  auto path = std::string{argv[1]}.substr(std::string{"--replay="}.size());
+  bool is_fresh = false;
+  for (int i = 2; i < argc; i++) {
+    if (std::string{argv[i]} != "--fresh") {
+      std::cout << "replay: unknown option " << argv[i] << '\n';
+      return 1;
+    }
+    is_fresh = true;
+  }
+
+  SessionRecorder::Recording recording;
+  if (!SessionRecorder::Load(path, recording)) {
+    std::cout << "replay: cannot read " << path << '\n';
+    return 1;
+  }
+
+  auto computer = Computer::Assemble();
+  computer.SetDateTime(std::chrono::system_clock::time_point{std::chrono::microseconds{recording.started}});
+
+  auto fs = MakeFileSystem(computer, 0, 0);
+  if (is_fresh) {
+    fs->for_dev_populate();
+  } else if (!fs->Restore(recording.snapshot)) {
+    std::cout << "replay: " << path << " holds a damaged snapshot\n";
+    return 1;
+  }
+
+  Shell shell{computer, fs};
+  shell.DetachTerminal();
+
+  std::vector<std::uint64_t> durations;
+  std::vector<std::pair<std::size_t, std::string>> divergences;
+
+  std::ostringstream sink;
+  auto *original = std::cout.rdbuf(sink.rdbuf());
+
+  auto started = Clock::now();
+  for (std::size_t i = 0; i < recording.entries.size(); i++) {
+    sink.str({});
+
+    auto before = Clock::now();
+    shell.Execute(recording.entries[i].line);
+    durations.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - before).count());
+
+    auto output = sink.str();
+    if (output != recording.entries[i].output) {
+      divergences.emplace_back(i, std::move(output));
+    }
+  }
+  auto wall = std::chrono::duration<double>(Clock::now() - started).count();
+
+  std::cout.rdbuf(original);
+
+  std::uint64_t recorded_busy = 0;
+  for (const auto &entry : recording.entries) {
+    recorded_busy += entry.duration;
+  }
+  double recorded_span = 0;
+  if (!recording.entries.empty()) {
+    const auto &last = recording.entries.back();
+    recorded_span = last.offset / 1e6 + last.duration / 1e9;
+  }
+
+  auto flags = std::cout.flags();
+  std::cout << std::fixed << std::setprecision(3);
+  std::cout << "session of " << recording.login << ", " << recording.entries.size() << " commands, "
+            << (is_fresh ? "fresh tree" : "recorded snapshot") << '\n';
+  std::cout << "replayed in " << wall << " s (recorded " << recorded_span << " s, " << recorded_busy / 1e9
+            << " s inside commands)\n";
+
+  std::size_t live = 0;
+  for (const auto &divergence : divergences) {
+    live += IsLiveOutput(recording.entries[divergence.first].line) ? 1 : 0;
+  }
+
+  std::cout << "divergences " << divergences.size();
+  if (live > 0) {
+    std::cout << ", " << live << " from date or stats, whose output differs by design";
+  }
+  std::cout << '\n';
+  for (std::size_t i = 0; i < divergences.size() && i < kDivergenceLimit; i++) {
+    auto index = divergences[i].first;
+    PrintDivergence(index, recording.entries[index], divergences[i].second);
+  }
+  if (divergences.size() > kDivergenceLimit) {
+    std::cout << "  ... " << divergences.size() - kDivergenceLimit << " more\n";
+  }
+
+  // Recorded times include writing to the terminal, replayed ones only
+  // formatting into memory, so the deltas are most telling between two
+  // replays of the same session on different builds.
+  std::map<std::string, std::pair<std::uint64_t, std::uint64_t>> totals;
+  std::map<std::string, std::size_t> counts;
+  for (std::size_t i = 0; i < recording.entries.size(); i++) {
+    const auto &line = recording.entries[i].line;
+    auto command = line.substr(0, line.find(' '));
+    totals[command].first += recording.entries[i].duration;
+    totals[command].second += durations[i];
+    counts[command]++;
+  }
+
+  std::cout << std::setprecision(1);
+  std::cout << "timings differ by design: recorded ones include writing to the terminal\n";
+  std::cout << "timing (us)   count    recorded    replayed     delta\n";
+  for (const auto &[command, total] : totals) {
+    auto delta = total.first == 0 ? 0.0 : 100.0 * (static_cast<double>(total.second) - total.first) / total.first;
+    std::cout << "  " << std::left << std::setw(10) << command << std::right << std::setw(7) << counts[command]
+              << std::setw(12) << total.first / 1000.0 << std::setw(12) << total.second / 1000.0 << std::setw(9)
+              << std::showpos << delta << std::noshowpos << "%\n";
+  }
+
+  std::vector<std::size_t> slower;
+  for (std::size_t i = 0; i < durations.size(); i++) {
+    if (durations[i] > recording.entries[i].duration) {
+      slower.push_back(i);
+    }
+  }
+  std::sort(slower.begin(), slower.end(), [&](std::size_t a, std::size_t b) {
+    return durations[a] - recording.entries[a].duration > durations[b] - recording.entries[b].duration;
+  });
+  if (slower.size() > kSlowestLimit) {
+    slower.resize(kSlowestLimit);
+  }
+
+  if (!slower.empty()) {
+    std::cout << "slower than recorded\n";
+  }
+  for (auto i : slower) {
+    std::cout << "  #" << i + 1 << ' ' << recording.entries[i].line << ": " << recording.entries[i].duration / 1000.0
+              << " -> " << durations[i] / 1000.0 << " us\n";
+  }
+  std::cout.flags(flags);
+
+  return divergences.size() == live ? 0 : 1;
+}
+
+// Lists every entry with its mode, size and content, in tree order, so
+// two file systems can be compared for equality.
+static std::string DescribeTree(FileSystem &fs) {
+  std::string description;
+  std::vector<std::vector<std::string>> pending{{"/"}};
+  while (!pending.empty()) {
+    auto path = std::move(pending.back());
+    pending.pop_back();
+
+    auto directory = fs.Resolve(path);
+    if (!directory) {
+      continue;
+    }
+
+    for (const auto &entry : directory->Entries()) {
+      auto entry_path = path;
+      entry_path.push_back(entry.Name());
+
+      for (std::size_t i = 1; i < entry_path.size(); i++) {
+        description += '/' + entry_path[i];
+      }
+      description += entry.IsDirectory() ? " d" : " -";
+      description += std::to_string(entry.Permission()) + ' ' + std::to_string(entry.Size());
+
+      if (entry.IsDirectory()) {
+        pending.push_back(entry_path);
       } else {
-        parameters.push_back(args[i]);
+        description += ' ';
+        fs.ReadFile(entry_path, [&](const char *data, std::size_t length) {
+          description.append(data, length);
+        });
       }
+      description += '\n';
     }
   }
 
-  argument.SetParameters(parameters);
-  argument.SetOptions(options);
+  return description;
+}
 
-  arg_ = argument;
+// Replays a journal written by a scripted session, then prefixes of it
+// cut around and inside every record: a torn tail must recover exactly
+// the records before the cut, and records appended afterwards must
+// survive a reopen.
+static std::vector<std::string> CheckJournal(const std::filesystem::path &directory) {
+  std::vector<std::string> problems;
+
+  auto image_path = (directory / "image").string();
+  auto journal_path = (directory / "journal").string();
+  auto open = [&](const std::string &image, const std::string &journal) {
+    auto fs = std::make_shared<FileSystem>(16 << 20, 1 << 20);
+    fs->Open(image, journal);
+    return fs;
+  };
 
-  auto cmd = arg_.ProgramName();
-  if (ContainsCommand(cmd)) {
-    commands_[cmd]->Execute(*this);
-    return;
+  std::string large(3 * BlockDevice::kBlockSize + 123, '\0');
+  for (std::size_t i = 0; i < large.size(); i++) {
+    large[i] = static_cast<char>('a' + i % 26);
   }
 
-  std::cout << "command not found: " << cmd << '\n';
+  std::vector<std::function<void(FileSystem &)>> script{
+    [](FileSystem &fs) { fs.MakeDirectory({"/", "a"}, false); },
+    [](FileSystem &fs) { fs.MakeDirectory({"/", "a", "b", "c"}, true); },
+    [](FileSystem &fs) { fs.CreateFile({"/", "a", "f"}); },
+    [](FileSystem &fs) { fs.WriteFile({"/", "a", "f"}, "hello", false); },
+    [](FileSystem &fs) { fs.WriteFile({"/", "a", "f"}, " world", true); },
+    [&](FileSystem &fs) { fs.WriteFile({"/", "tmp", "big"}, large, false); },
+    [](FileSystem &fs) { fs.Truncate({"/", "tmp", "big"}, BlockDevice::kBlockSize + 7); },
+    [](FileSystem &fs) { fs.Truncate({"/", "a", "f"}, 3); },
+    [](FileSystem &fs) { fs.ChangeMode({"/", "a"}, 5, true); },
+    [](FileSystem &fs) { fs.Remove({"/", "a", "b"}, true); },
+    [](FileSystem &fs) { fs.Remove({"/", "log.txt"}, false); },
+    [](FileSystem &fs) { fs.WriteFile({"/", "tmp", "file.txt"}, "tail", true); },
+  };
+
+  std::vector<std::string> states;
+  {
+    auto fs = open(image_path, journal_path);
+    states.push_back(DescribeTree(*fs));
+    for (const auto &step : script) {
+      step(*fs);
+      states.push_back(DescribeTree(*fs));
+    }
+  }
+
+  std::string journal;
+  ReadWholeFile(journal_path, journal);
+  auto scratch_image = (directory / "scratch_image").string();
+  auto scratch_journal = (directory / "scratch_journal").string();
+  auto prepare = [&](const std::string &content) {
+    std::filesystem::copy_file(image_path, scratch_image, std::filesystem::copy_options::overwrite_existing);
+    std::ofstream{scratch_journal, std::ios::binary | std::ios::trunc} << content;
+  };
+
+  // Records are framed as a varint length, the payload and a 4-byte
+  // checksum. Cuts land on each boundary, inside the length, in the middle
+  // of the payload and on every checksum byte. The 12-byte header holds
+  // the generation, so a cut inside it is not a torn record.
+  constexpr std::size_t kHeaderSize = 12;
+  std::set<std::size_t> cuts{kHeaderSize};
+  const char *in = journal.data() + std::min(kHeaderSize, journal.size());
+  const char *end = journal.data() + journal.size();
+  while (in < end) {
+    std::size_t start = in - journal.data();
+    std::uint64_t size;
+    if (!GetVarint(in, end, size) || size + 4 > static_cast<std::uint64_t>(end - in)) {
+      problems.push_back("journal holds a malformed record at byte " + std::to_string(start));
+      return problems;
+    }
+    in += size + 4;
+
+    std::size_t record_end = in - journal.data();
+    cuts.insert({start + 1, start + (record_end - start) / 2, record_end});
+    for (auto length = record_end - 4; length < record_end; length++) {
+      cuts.insert(length);
+    }
+  }
+
+  std::size_t last = 0;
+  std::set<std::size_t> reached;
+  for (auto length : cuts) {
+    prepare(journal.substr(0, length));
+    auto fs = open(scratch_image, scratch_journal);
+
+    auto state = std::find(states.begin() + last, states.end(), DescribeTree(*fs));
+    if (state == states.end()) {
+      problems.push_back("journal cut at " + std::to_string(length) + " bytes replays to no prefix of the script");
+      break;
+    }
+    last = state - states.begin();
+    reached.insert(last);
+
+    for (const auto &problem : fs->Check()) {
+      problems.push_back("journal cut at " + std::to_string(length) + " bytes: " + problem);
+    }
+  }
+
+  if (problems.empty() && (reached.size() != states.size() || last != states.size() - 1)) {
+    problems.push_back("journal cuts recovered " + std::to_string(reached.size()) + " of " +
+                       std::to_string(states.size()) + " record boundaries");
+  }
+
+  prepare(journal.substr(0, journal.size() - 3));
+  std::string appended;
+  {
+    auto fs = open(scratch_image, scratch_journal);
+    fs->MakeDirectory({"/", "after"}, false);
+    appended = DescribeTree(*fs);
+  }
+  if (DescribeTree(*open(scratch_image, scratch_journal)) != appended) {
+    problems.push_back("record appended after a torn tail was lost on reopen");
+  }
+
+  prepare(journal + std::string(64, '\xff'));
+  if (DescribeTree(*open(scratch_image, scratch_journal)) != states.back()) {
+    problems.push_back("garbage after the last record changed the replayed tree");
+  }
+
+  // A damaged image loads nothing, and neither it nor its journal is
+  // touched by the session that follows.
+  std::string image;
+  ReadWholeFile(image_path, image);
+  prepare(journal);
+  std::ofstream{scratch_image, std::ios::binary | std::ios::trunc} << image.substr(0, image.size() / 2);
+  {
+    auto fs = std::make_shared<FileSystem>(16 << 20, 1 << 20);
+    if (fs->Open(scratch_image, scratch_journal)) {
+      problems.push_back("an image cut in half was loaded");
+    }
+    fs->MakeDirectory({"/", "unsaved"}, false);
+    fs->Sync();
+  }
+  std::string left_image, left_journal;
+  ReadWholeFile(scratch_image, left_image);
+  ReadWholeFile(scratch_journal, left_journal);
+  if (left_image != image.substr(0, image.size() / 2) || left_journal != journal) {
+    problems.push_back("opening a damaged image changed the image or its journal");
+  }
+
+#if defined(__linux__)
+  // Writes past RLIMIT_FSIZE fail with EFBIG, which stands in for a full
+  // disk: the journal must report the lost records and refuse further
+  // mutations, and the checkpoint a sync attempts must not replace the
+  // image with a short one. Once writes succeed again, a sync recovers.
+  auto failing_image = (directory / "failing_image").string();
+  auto failing_journal = (directory / "failing_journal").string();
+  std::string recovered;
+  {
+    auto fs = open(failing_image, failing_journal);
+    std::string saved_image;
+    ReadWholeFile(failing_image, saved_image);
+
+    rlimit limit;
+    getrlimit(RLIMIT_FSIZE, &limit);
+    auto lowered = limit;
+    lowered.rlim_cur = 4096;
+    auto *previous = signal(SIGXFSZ, SIG_IGN);
+    setrlimit(RLIMIT_FSIZE, &lowered);
+
+    bool is_accepted = fs->WriteFile({"/", "big"}, large, false) == FileSystem::Status::kOk;
+    auto sync_status = fs->Sync();
+    auto blocked_status = fs->MakeDirectory({"/", "blocked"}, false);
+
+    setrlimit(RLIMIT_FSIZE, &limit);
+    signal(SIGXFSZ, previous);
+
+    std::string failed_image;
+    ReadWholeFile(failing_image, failed_image);
+    if (!is_accepted || sync_status != FileSystem::Status::kIoError) {
+      problems.push_back("a failed journal write was not reported by sync");
+    }
+    if (blocked_status != FileSystem::Status::kIoError) {
+      problems.push_back("a mutation was accepted after the journal failed");
+    }
+    if (failed_image != saved_image) {
+      problems.push_back("a failed checkpoint replaced the image");
+    }
+
+    if (fs->Sync() != FileSystem::Status::kOk || fs->MakeDirectory({"/", "after"}, false) != FileSystem::Status::kOk) {
+      problems.push_back("sync did not recover the journal once writes succeeded again");
+    }
+    recovered = DescribeTree(*fs);
+  }
+  if (DescribeTree(*open(failing_image, failing_journal)) != recovered) {
+    problems.push_back("the tree saved by a recovering sync did not survive a reopen");
+  }
+#endif
+
+  return problems;
 }
 
-bool Shell::ContainsCommand(const std::string &cmd) {
-  return commands_.find(cmd) != commands_.end();
+// Drives the buddy allocator through random allocations and releases on
+// a device whose size is not a power of two, then files through random
+// writes and truncations, checking the free lists after every step and
+// file contents against a model.
+static std::vector<std::string> CheckBlockDevice() {
+  std::vector<std::string> problems;
+  std::mt19937_64 random{1};
+
+  BlockDevice device{1000 * BlockDevice::kBlockSize};
+  auto initial_extents = device.FreeExtents();
+  auto initial_largest = device.LargestFreeExtent();
+
+  std::vector<char> block(BlockDevice::kBlockSize, 'x');
+  std::vector<std::vector<BlockDevice::Extent>> allocations;
+  for (int step = 0; step < 20000 && problems.empty(); step++) {
+    if (allocations.empty() || random() % 5 < 3) {
+      auto count = 1 + random() % 96;
+      auto free_blocks = device.FreeBlocks();
+
+      std::vector<BlockDevice::Extent> extents;
+      bool is_allocated = device.Allocate(count, extents);
+      if (is_allocated != (count <= free_blocks)) {
+        problems.push_back("step " + std::to_string(step) + ": allocating " + std::to_string(count) + " of " +
+                           std::to_string(free_blocks) + " free blocks " + (is_allocated ? "succeeded" : "failed"));
+        break;
+      }
+      if (!is_allocated) {
+        continue;
+      }
+
+      std::uint64_t blocks = 0;
+      for (const auto &extent : extents) {
+        blocks += std::uint64_t{1} << extent.order;
+      }
+      if (blocks != count) {
+        problems.push_back("step " + std::to_string(step) + ": asked for " + std::to_string(count) + " blocks, got " +
+                           std::to_string(blocks));
+      }
+
+      device.Write(extents.front().start, block.data());
+      allocations.push_back(std::move(extents));
+    } else {
+      auto index = random() % allocations.size();
+      for (const auto &extent : allocations[index]) {
+        device.Release(extent);
+      }
+      allocations[index] = std::move(allocations.back());
+      allocations.pop_back();
+    }
+
+    std::vector<BlockDevice::Extent> in_use;
+    for (const auto &extents : allocations) {
+      in_use.insert(in_use.end(), extents.begin(), extents.end());
+    }
+    for (const auto &problem : device.Check(std::move(in_use))) {
+      problems.push_back("step " + std::to_string(step) + ": " + problem);
+    }
+  }
+
+  for (const auto &extents : allocations) {
+    for (const auto &extent : extents) {
+      device.Release(extent);
+    }
+  }
+  if (problems.empty() && (device.FreeExtents() != initial_extents || device.LargestFreeExtent() != initial_largest)) {
+    problems.push_back("releasing everything left " + std::to_string(device.FreeExtents()) +
+                       " free extents, largest " + std::to_string(device.LargestFreeExtent()) + " blocks");
+  }
+
+  FileSystem fs{256 * BlockDevice::kBlockSize, 16 * BlockDevice::kBlockSize};
+  fs.SetRoot(std::make_shared<Directory>());
+
+  std::vector<std::string> contents(4);
+  for (int step = 0; step < 2000 && problems.empty(); step++) {
+    auto index = random() % contents.size();
+    std::vector<std::string> path{"/", "f" + std::to_string(index)};
+    auto size = random() % (48 * BlockDevice::kBlockSize);
+
+    if (random() % 2 == 0) {
+      std::string data(size, static_cast<char>('a' + step % 26));
+      if (fs.WriteFile(path, data, false) == FileSystem::Status::kOk) {
+        contents[index] = data;
+      }
+    } else if (fs.Truncate(path, size) == FileSystem::Status::kOk) {
+      contents[index].resize(size, '\0');
+    }
+
+    std::string actual;
+    fs.ReadFile(path, [&](const char *data, std::size_t length) {
+      actual.append(data, length);
+    });
+    if (actual != contents[index]) {
+      problems.push_back("step " + std::to_string(step) + ": " + path[1] + " reads back " +
+                         std::to_string(actual.size()) + " bytes that differ from the " +
+                         std::to_string(contents[index].size()) + " written");
+    }
+
+    for (const auto &problem : fs.Check()) {
+      problems.push_back("step " + std::to_string(step) + ": " + problem);
+    }
+  }
+
+  return problems;
+}
+
+// Runs random reads, writes, read-ahead, discards and flushes through a
+// small cache against a model: reads must return the last write, evicted
+// dirty pages must reach the device, discarded ones never. A scan must
+// not push out pages that were read twice before it.
+static std::vector<std::string> CheckPageCache() {
+  std::vector<std::string> problems;
+  std::mt19937_64 random{2};
+
+  constexpr std::uint64_t kBlocks = 64;
+  BlockDevice device{kBlocks * BlockDevice::kBlockSize};
+  PageCache cache{device, 8};
+
+  auto fill = [](std::vector<char> &block, std::uint64_t tag) {
+    std::fill(block.begin(), block.end(), static_cast<char>(tag));
+    std::memcpy(block.data(), &tag, sizeof(tag));
+  };
+
+  std::vector<std::vector<char>> model(kBlocks, std::vector<char>(BlockDevice::kBlockSize, '\0'));
+  std::vector<char> buffer(BlockDevice::kBlockSize);
+  std::uint64_t reads = 0;
+
+  auto compare_device = [&](int step) {
+    for (std::uint64_t block = 0; block < kBlocks; block++) {
+      device.Read(block, buffer.data());
+      if (buffer != model[block]) {
+        problems.push_back("step " + std::to_string(step) + ": device block " + std::to_string(block) +
+                           " differs from the last write after a flush");
+        return;
+      }
+    }
+  };
+
+  for (int step = 0; step < 50000 && problems.empty(); step++) {
+    auto block = random() % kBlocks;
+    switch (random() % 10) {
+      case 0:
+      case 1:
+      case 2:
+        fill(model[block], block << 32 | static_cast<std::uint64_t>(step));
+        cache.Write(block, model[block].data());
+        break;
+      case 3:
+        cache.ReadAhead(block, std::min<std::uint64_t>(1 + random() % 8, kBlocks - block));
+        break;
+      case 4: {
+        auto order = static_cast<unsigned char>(random() % 4);
+        auto start = block & ~((std::uint64_t{1} << order) - 1);
+        for (auto b = start; b < start + (std::uint64_t{1} << order); b++) {
+          device.Read(b, model[b].data());
+        }
+        cache.Discard({start, order});
+        break;
+      }
+      case 5:
+        if (random() % 8 == 0) {
+          cache.Flush();
+          if (cache.DirtyPages() != 0) {
+            problems.push_back("step " + std::to_string(step) + ": " + std::to_string(cache.DirtyPages()) +
+                               " dirty pages left after a flush");
+          }
+          compare_device(step);
+        }
+        break;
+      default:
+        cache.Read(block, buffer.data());
+        reads++;
+        if (buffer != model[block]) {
+          problems.push_back("step " + std::to_string(step) + ": block " + std::to_string(block) +
+                             " reads back something other than its last write");
+        }
+        break;
+    }
+
+    if (cache.Size() > cache.Capacity() || cache.DirtyPages() > cache.Size()) {
+      problems.push_back("step " + std::to_string(step) + ": " + std::to_string(cache.Size()) + " pages, " +
+                         std::to_string(cache.DirtyPages()) + " dirty, in a cache of " +
+                         std::to_string(cache.Capacity()));
+    }
+  }
+
+  const auto &counters = cache.GetCounters();
+  if (problems.empty() && counters.hits + counters.misses != reads) {
+    problems.push_back(std::to_string(reads) + " reads counted as " + std::to_string(counters.hits) + " hits and " +
+                       std::to_string(counters.misses) + " misses");
+  }
+
+  cache.Flush();
+  if (problems.empty()) {
+    compare_device(-1);
+  }
+
+  constexpr std::uint64_t kScanBlocks = 1024;
+  BlockDevice scan_device{kScanBlocks * BlockDevice::kBlockSize};
+  PageCache scan_cache{scan_device, 64};
+  constexpr std::uint64_t kHotBlocks = 16;
+  for (int pass = 0; pass < 2; pass++) {
+    for (std::uint64_t block = 0; block < kHotBlocks; block++) {
+      scan_cache.Read(block, buffer.data());
+    }
+  }
+  for (auto block = kHotBlocks; block < kScanBlocks; block++) {
+    scan_cache.ReadAhead(block, 1);
+    scan_cache.Read(block, buffer.data());
+  }
+
+  auto hits = scan_cache.GetCounters().hits;
+  for (std::uint64_t block = 0; block < kHotBlocks; block++) {
+    scan_cache.Read(block, buffer.data());
+  }
+  auto kept = scan_cache.GetCounters().hits - hits;
+  if (kept != kHotBlocks) {
+    problems.push_back("a " + std::to_string(kScanBlocks - kHotBlocks) + "-block scan evicted " +
+                       std::to_string(kHotBlocks - kept) + " of " + std::to_string(kHotBlocks) + " hot pages");
+  }
+
+  return problems;
+}
+
+// Grows and shrinks one directory across the size at which it starts and
+// stops keeping a lookup, comparing Find for every name with a scan and
+// the entry order with the order of insertion.
+static std::vector<std::string> CheckDirectory() {
+  std::vector<std::string> problems;
+  std::mt19937_64 random{3};
+
+  constexpr std::size_t kNames = 300;
+  Directory directory;
+  std::vector<std::string> model;
+  for (int step = 0; step < 6000 && problems.empty(); step++) {
+    auto name = "n" + std::to_string(random() % kNames);
+    auto position = std::find(model.begin(), model.end(), name);
+
+    // Growing phases alternate with shrinking ones so the size keeps
+    // crossing both thresholds.
+    bool is_growing = step / 600 % 2 == 0;
+    if (position == model.end() && (is_growing || random() % 4 == 0)) {
+      directory.Add(random() % 2 == 0 ? FileOrDirectory::CreateFile(name) : FileOrDirectory::CreateDirectory(name));
+      model.push_back(name);
+    } else if (position != model.end() && (!is_growing || random() % 4 == 0)) {
+      directory.Erase(directory.Find(NameTable::Global().Find(name)));
+      model.erase(position);
+    }
+
+    const auto &entries = directory.Entries();
+    bool is_same = entries.size() == model.size();
+    for (std::size_t i = 0; is_same && i < model.size(); i++) {
+      is_same = entries[i].Name() == model[i];
+    }
+    if (!is_same) {
+      problems.push_back("step " + std::to_string(step) + ": entries are not in insertion order");
+      break;
+    }
+
+    // Every name is looked up on every tenth step, the touched one always.
+    for (std::size_t i = 0; i < kNames; i++) {
+      auto probe = step % 10 == 0 ? "n" + std::to_string(i) : name;
+      auto it = directory.Find(NameTable::Global().Find(probe));
+      auto expected = std::find(model.begin(), model.end(), probe);
+      if (it - entries.begin() != expected - model.begin()) {
+        problems.push_back("step " + std::to_string(step) + ": Find(" + probe + ") disagrees with a scan of " +
+                           std::to_string(model.size()) + " entries");
+        break;
+      }
+      if (step % 10 != 0) {
+        break;
+      }
+    }
+  }
+
+  return problems;
+}
+
+static std::vector<std::string> CheckLoad() {
+  std::vector<std::string> problems;
+
+  // A 30-name pool runs out in directories of up to 25 entries, so the
+  // generator has to fall back to fresh names.
+  for (std::size_t vocabulary : {0, 30, 2000}) {
+    Workload::Options options;
+    options.seed = 5;
+    options.depth = 5;
+    options.fanout = 12;
+    options.vocabulary = vocabulary;
+    options.operations = 5000;
+
+    Workload workload{options};
+    auto computer = Computer::Assemble();
+    auto fs = MakeFileSystem(computer, 0, 0);
+    fs->SetRoot(workload.GenerateTree());
+
+    auto label = "--vocabulary=" + std::to_string(vocabulary);
+    for (const auto &problem : fs->Check()) {
+      problems.push_back(label + ", generated tree: " + problem);
+    }
+
+    Shell shell{computer, fs};
+    std::ostringstream output;
+    auto *saved = std::cout.rdbuf(output.rdbuf());
+    workload.Run(shell, fs);
+    std::cout.rdbuf(saved);
+
+    for (const auto &problem : fs->Check()) {
+      problems.push_back(label + ", after " + std::to_string(options.operations) + " ops: " + problem);
+    }
+  }
+
+  return problems;
+}
+
+static int RunSelfCheck(int argc, char **argv) {
+  if (argc > 2) {
+    std::cout << "self-check: unknown option " << argv[2] << '\n';
+    return 1;
+  }
+
+  auto directory = std::filesystem::temp_directory_path() /
+                   ("proses-self-check-" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()));
+  std::filesystem::create_directories(directory);
+
+  std::vector<std::pair<const char *, std::function<std::vector<std::string>()>>> checks{
+    {"journal", [&] { return CheckJournal(directory); }},
+    {"block device", CheckBlockDevice},
+    {"page cache", CheckPageCache},
+    {"directory", CheckDirectory},
+    {"load", CheckLoad},
+  };
+
+  bool is_clean = true;
+  for (const auto &[name, check] : checks) {
+    auto problems = check();
+    std::cout << name << ": " << (problems.empty() ? "ok" : "FAILED") << '\n';
+    for (const auto &problem : problems) {
+      std::cout << "  " << problem << '\n';
+    }
+    is_clean = is_clean && problems.empty();
+  }
+
+  std::error_code error;
+  std::filesystem::remove_all(directory, error);
+
+  return is_clean ? 0 : 1;
 }
 
-int main() {
+int main(int argc, char **argv) {
+  std::string record_path;
+  if (argc > 1) {
+    std::string mode{argv[1]};
+    if (mode == "--load") {
+      return RunLoad(argc, argv);
+    }
+    if (mode == "--self-check") {
+      return RunSelfCheck(argc, argv);
+    }
+    if (mode == "--bench-format") {
+      return RunFormatBench(argc, argv);
+    }
+    if (mode.compare(0, 9, "--replay=") == 0) {
+      return RunReplay(argc, argv);
+    }
+    if (mode.compare(0, 9, "--record=") == 0) {
+      record_path = mode.substr(9);
+    }
+  }
+
   auto computer = Computer::Boot();
 
   Shell shell{computer};
+  if (!record_path.empty()) {
+    shell.Record(record_path);
+  }
   shell.MainLoop();
 
   return 0;